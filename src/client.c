@@ -30,25 +30,37 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include <plist/plist.h>
 
 #include "collection.h"
 #include "log.h"
 #include "usb.h"
+#include "usb_bus.h"
+#include "usb_cache.h"
 #include "utils.h"
 #include "client.h"
 #include "device.h"
 #include "conf.h"
+#include "plist_scan.h"
 
-#define CMD_BUF_SIZE	0x10000
-#define REPLY_BUF_SIZE	0x10000
+// command buffers start out sized for a header and a typical plist and
+// grow up to CMD_BUF_MAX for the occasional large message
+#define CMD_BUF_INITIAL	0x800
+#define CMD_BUF_MAX	0x10000
+// unsent output a client may accumulate before it is disconnected
+#define CLIENT_OUTPUT_MAX	(1024 * 1024)
+// segments handed to a single sendmsg()
+#define OUTPUT_IOV_MAX	16
 
 enum client_state {
 	CLIENT_COMMAND,		// waiting for command
@@ -59,11 +71,39 @@ enum client_state {
 	CLIENT_DEAD
 };
 
+// a complete message, header included, queued to any number of clients
+struct shared_msg {
+	int refcount;
+	uint32_t length;
+	unsigned char *data;
+};
+
+struct out_segment {
+	struct shared_msg *msg;
+	uint32_t offset;	// bytes already sent
+	struct out_segment *next;
+};
+
+#define LISTEN_ATTACHED	(1 << 0)
+#define LISTEN_DETACHED	(1 << 1)
+#define LISTEN_PAIRED	(1 << 2)
+#define LISTEN_ALL	(LISTEN_ATTACHED | LISTEN_DETACHED | LISTEN_PAIRED)
+
+// what a Listen client asked to be told about
+struct listen_filter {
+	char **serials;	// NULL terminated, NULL for any device
+	int match_pid;
+	uint16_t pid;
+	uint32_t location, location_mask;	// mask 0 for any location
+	int events;	// LISTEN_* bits
+};
+
 struct mux_client {
 	int fd;
-	unsigned char *ob_buf;
-	uint32_t ob_size;
-	uint32_t ob_capacity;
+	pthread_mutex_t ob_mutex;	// events are queued from other threads
+	struct out_segment *ob_head, *ob_tail;
+	uint32_t ob_size;	// unsent bytes in the chain
+	int ob_overflow;
 	unsigned char *ib_buf;
 	uint32_t ib_size;
 	uint32_t ib_capacity;
@@ -72,14 +112,139 @@ struct mux_client {
 	int connect_device;
 	enum client_state state;
 	uint32_t proto_version;
+	int binary_plist;	// client sent or asked for bplist00, reply in kind
 	uint32_t number;
 	plist_t info;
+	struct listen_filter *filter;	// NULL for all devices and events
+	int accept_batches;	// takes AttachedBatch messages
+	plist_t batch;	// events for the next AttachedBatch
 };
 
 static struct collection client_list;
 pthread_mutex_t client_list_mutex;
 static uint32_t client_number = 0;
 
+/*
+ * Listeners are indexed so that a device event only visits the clients
+ * that want it: those without a serial number filter, those that asked
+ * for the device's serial number, and, once a device is attached, the
+ * listeners that matched it. Guarded by client_list_mutex.
+ */
+static struct collection any_listeners;
+static struct collection serial_index;	// struct serial_listeners
+static struct collection device_index;	// struct device_listeners
+
+struct serial_listeners {
+	char *serial;
+	struct collection clients;
+};
+
+struct device_listeners {
+	int device_id;
+	struct device_info info;	// serial is a private copy
+	struct collection clients;
+};
+
+enum plist_format {
+	PLIST_FORMAT_XML,
+	PLIST_FORMAT_BINARY,
+	PLIST_NUM_FORMATS
+};
+
+// how much plist encoding and decoding costs, per format
+struct plist_format_stats {
+	uint64_t encoded;
+	uint64_t encoded_bytes;
+	uint64_t encode_time;	// microseconds
+	uint64_t reused;	// replies sent from an earlier encoding
+	uint64_t decoded;
+	uint64_t decoded_bytes;
+	uint64_t decode_time;
+	uint64_t scanned;	// commands read without libplist, see plist_scan.c
+	uint64_t scan_time;
+	uint64_t scan_fallbacks;
+};
+
+// updated from the main, preflight and batch threads; a leaf lock
+static struct plist_format_stats format_stats[PLIST_NUM_FORMATS];
+static pthread_mutex_t format_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// a plist encoded at most once per format, for messages many clients get
+struct encoded_plist {
+	plist_t plist;
+	char *data[PLIST_NUM_FORMATS];
+	uint32_t size[PLIST_NUM_FORMATS];
+};
+
+/*
+ * ListDevices replies and the Attached messages for new listeners, built
+ * from a device snapshot and encoded on demand until the device list
+ * changes, see device_snapshot_get().
+ */
+static struct {
+	struct device_snapshot *snap;
+	struct encoded_plist list;
+	struct encoded_plist *attached;	// one per visible device
+} list_cache;
+static pthread_mutex_t list_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+enum event_flavour {
+	EVENT_BINARY,	// protocol version 0
+	EVENT_XML,
+	EVENT_BPLIST,
+	NUM_EVENT_FLAVOURS
+};
+
+// a device event, encoded at most once per flavour for all listeners
+struct device_event {
+	enum usbmuxd_msgtype msg;	// and payload, for version 0 listeners
+	const void *payload;
+	uint32_t payload_length;
+	struct encoded_plist plist;
+	struct shared_msg *encoded[NUM_EVENT_FLAVOURS];
+};
+
+/*
+ * Every device event gets a sequence number, and the latest ones are
+ * kept so a listener that comes back with the last number it saw is only
+ * sent what it missed. Numbers start from the daemon's start time, so
+ * one from a previous instance is never mistaken for a recent one.
+ * Guarded by client_list_mutex.
+ */
+#define EVENT_JOURNAL_SIZE	256
+
+struct journal_entry {
+	int event;	// LISTEN_* bit
+	struct device_info info;	// serial is a private copy
+	struct encoded_plist plist;
+};
+
+static struct journal_entry journal[EVENT_JOURNAL_SIZE];	// by seq % EVENT_JOURNAL_SIZE
+static uint64_t event_seq;	// of the latest event
+static uint64_t journal_start;	// event_seq when the daemon started
+
+/*
+ * When a hub full of devices comes up, events arrive in bursts from the
+ * preflight threads. With a batch window, events are held for that long
+ * after the first one and then queued to each listener together, so they
+ * leave in one sendmsg(). Listeners that accept it get a single
+ * AttachedBatch message instead. Guarded by client_list_mutex.
+ */
+struct pending_event {
+	struct device_event ev;
+	unsigned char payload[sizeof(struct usbmuxd_device_record)];
+	struct collection clients;	// listeners that want the event
+};
+
+static int event_batch_ms = 0;
+static struct collection pending_events;
+static pthread_t batch_thread;
+static pthread_cond_t batch_cond = PTHREAD_COND_INITIALIZER;
+static int batch_quit = 0;
+static uint64_t batch_flushes = 0, batch_events = 0;
+// wakes up the main loop to poll for the output of a flush
+static int batch_wakeup[2] = { -1, -1 };
+
 #ifdef SO_PEERCRED
 static char* _get_process_name_by_pid(const int pid)
 {
@@ -116,6 +281,21 @@ int client_read(struct mux_client *client, void *buffer, uint32_t len)
 		usbmuxd_log(LL_ERROR, "Attempted to read from client %d not in CONNECTED state", client->fd);
 		return -1;
 	}
+	if(client->ib_size > 0) {
+		// payload that was pipelined behind the Connect command
+		if(len > client->ib_size)
+			len = client->ib_size;
+		memcpy(buffer, client->ib_buf, len);
+		client->ib_size -= len;
+		if(client->ib_size) {
+			memmove(client->ib_buf, client->ib_buf + len, client->ib_size);
+		} else {
+			free(client->ib_buf);
+			client->ib_buf = NULL;
+			client->ib_capacity = 0;
+		}
+		return len;
+	}
 	return recv(client->fd, buffer, len, 0);
 }
 
@@ -174,12 +354,14 @@ int client_set_events(struct mux_client *client, short events)
 static void client_init2(struct mux_client *client, int fd)
 {
 	client->fd = fd;
-	client->ob_buf = malloc(REPLY_BUF_SIZE);
+	pthread_mutex_init(&client->ob_mutex, NULL);
+	client->ob_head = client->ob_tail = NULL;
 	client->ob_size = 0;
-	client->ob_capacity = REPLY_BUF_SIZE;
-	client->ib_buf = malloc(CMD_BUF_SIZE);
+	client->ob_overflow = 0;
+	// allocated when the client first sends something
+	client->ib_buf = NULL;
 	client->ib_size = 0;
-	client->ib_capacity = CMD_BUF_SIZE;
+	client->ib_capacity = 0;
 	client->state = CLIENT_COMMAND;
 	client->events = POLLIN;
 	client->info = NULL;
@@ -275,6 +457,278 @@ int client_accept(int listenfd)
 	return client->fd;
 }
 
+static struct shared_msg *shared_msg_new(uint32_t version, uint32_t tag, enum usbmuxd_msgtype msg, const void *payload, uint32_t payload_length)
+{
+	struct usbmuxd_header hdr;
+	struct shared_msg *smsg = malloc(sizeof(struct shared_msg));
+	hdr.version = version;
+	hdr.length = sizeof(hdr) + payload_length;
+	hdr.message = msg;
+	hdr.tag = tag;
+	smsg->refcount = 1;
+	smsg->length = hdr.length;
+	smsg->data = malloc(hdr.length);
+	memcpy(smsg->data, &hdr, sizeof(hdr));
+	if(payload && payload_length)
+		memcpy(smsg->data + sizeof(hdr), payload, payload_length);
+	return smsg;
+}
+
+// listeners are fed from whatever thread reports the event, hence atomic
+static void shared_msg_unref(struct shared_msg *smsg)
+{
+	if(__sync_sub_and_fetch(&smsg->refcount, 1) == 0) {
+		free(smsg->data);
+		free(smsg);
+	}
+}
+
+static void listen_filter_free(struct listen_filter *filter)
+{
+	int i;
+	if(!filter)
+		return;
+	for(i = 0; filter->serials && filter->serials[i]; i++)
+		free(filter->serials[i]);
+	free(filter->serials);
+	free(filter);
+}
+
+/**
+ * Read the optional filters of a Listen request: SerialNumbers (array of
+ * strings), ProductID, LocationIDPrefix (a location whose trailing zero
+ * nibbles match anything) and MessageTypes (array of "Attached",
+ * "Detached" and "Paired").
+ *
+ * @param filter set to NULL if the request has no filter
+ * @return 0 on success, -1 if a filter is malformed
+ */
+static int listen_filter_parse(plist_t dict, struct listen_filter **filter)
+{
+	struct listen_filter *f;
+	plist_t node;
+	uint64_t val;
+	uint32_t i, count;
+
+	*filter = NULL;
+	if(!plist_dict_get_item(dict, "SerialNumbers") && !plist_dict_get_item(dict, "ProductID")
+	   && !plist_dict_get_item(dict, "LocationIDPrefix") && !plist_dict_get_item(dict, "MessageTypes"))
+		return 0;
+
+	f = malloc(sizeof(struct listen_filter));
+	memset(f, 0, sizeof(struct listen_filter));
+	f->events = LISTEN_ALL;
+
+	node = plist_dict_get_item(dict, "SerialNumbers");
+	if(node) {
+		if(plist_get_node_type(node) != PLIST_ARRAY)
+			goto error;
+		count = plist_array_get_size(node);
+		f->serials = calloc(count + 1, sizeof(char*));
+		for(i = 0; i < count; i++) {
+			plist_t item = plist_array_get_item(node, i);
+			if(plist_get_node_type(item) != PLIST_STRING)
+				goto error;
+			plist_get_string_val(item, &f->serials[i]);
+		}
+	}
+	node = plist_dict_get_item(dict, "ProductID");
+	if(node) {
+		if(plist_get_node_type(node) != PLIST_UINT)
+			goto error;
+		plist_get_uint_val(node, &val);
+		f->match_pid = 1;
+		f->pid = (uint16_t)val;
+	}
+	node = plist_dict_get_item(dict, "LocationIDPrefix");
+	if(node) {
+		if(plist_get_node_type(node) != PLIST_UINT)
+			goto error;
+		plist_get_uint_val(node, &val);
+		f->location = (uint32_t)val;
+		if(f->location) {
+			uint32_t prefix = f->location;
+			f->location_mask = 0xFFFFFFFF;
+			while(!(prefix & 0xF)) {
+				prefix >>= 4;
+				f->location_mask <<= 4;
+			}
+		}
+	}
+	node = plist_dict_get_item(dict, "MessageTypes");
+	if(node) {
+		if(plist_get_node_type(node) != PLIST_ARRAY)
+			goto error;
+		f->events = 0;
+		count = plist_array_get_size(node);
+		for(i = 0; i < count; i++) {
+			plist_t item = plist_array_get_item(node, i);
+			char *type = NULL;
+			if(plist_get_node_type(item) != PLIST_STRING)
+				goto error;
+			plist_get_string_val(item, &type);
+			if(!strcmp(type, "Attached"))
+				f->events |= LISTEN_ATTACHED;
+			else if(!strcmp(type, "Detached"))
+				f->events |= LISTEN_DETACHED;
+			else if(!strcmp(type, "Paired"))
+				f->events |= LISTEN_PAIRED;
+			else {
+				free(type);
+				goto error;
+			}
+			free(type);
+		}
+	}
+	*filter = f;
+	return 0;
+
+error:
+	listen_filter_free(f);
+	return -1;
+}
+
+static int listen_filter_has_serial(struct listen_filter *filter, const char *serial)
+{
+	int i;
+	if(!filter || !filter->serials)
+		return 1;
+	for(i = 0; filter->serials[i]; i++) {
+		if(!strcmp(filter->serials[i], serial))
+			return 1;
+	}
+	return 0;
+}
+
+// the serial number part of the filter is checked by the index
+static int listen_filter_matches(struct listen_filter *filter, struct device_info *dev)
+{
+	if(!filter)
+		return 1;
+	if(filter->match_pid && filter->pid != dev->pid)
+		return 0;
+	if((dev->location & filter->location_mask) != filter->location)
+		return 0;
+	return 1;
+}
+
+static int listen_filter_wants(struct listen_filter *filter, int event)
+{
+	return !filter || (filter->events & event);
+}
+
+static int listener_in(struct collection *col, struct mux_client *client)
+{
+	FOREACH(struct mux_client *lc, col) {
+		if(lc == client)
+			return 1;
+	} ENDFOREACH
+	return 0;
+}
+
+static struct serial_listeners *serial_index_find(const char *serial)
+{
+	FOREACH(struct serial_listeners *sl, &serial_index) {
+		if(!strcmp(sl->serial, serial))
+			return sl;
+	} ENDFOREACH
+	return NULL;
+}
+
+static struct device_listeners *device_index_find(int device_id)
+{
+	FOREACH(struct device_listeners *dl, &device_index) {
+		if(dl->device_id == device_id)
+			return dl;
+	} ENDFOREACH
+	return NULL;
+}
+
+// client_list_mutex must be held
+static void listener_register(struct mux_client *client)
+{
+	int i;
+	if(!client->filter || !client->filter->serials) {
+		collection_add(&any_listeners, client);
+		return;
+	}
+	for(i = 0; client->filter->serials[i]; i++) {
+		struct serial_listeners *sl = serial_index_find(client->filter->serials[i]);
+		if(!sl) {
+			sl = malloc(sizeof(struct serial_listeners));
+			sl->serial = strdup(client->filter->serials[i]);
+			collection_init(&sl->clients);
+			collection_add(&serial_index, sl);
+		}
+		if(!listener_in(&sl->clients, client))
+			collection_add(&sl->clients, client);
+	}
+}
+
+// client_list_mutex must be held
+static void listener_unregister(struct mux_client *client)
+{
+	if(listener_in(&any_listeners, client))
+		collection_remove(&any_listeners, client);
+	FOREACH(struct serial_listeners *sl, &serial_index) {
+		if(!listener_in(&sl->clients, client))
+			continue;
+		collection_remove(&sl->clients, client);
+		if(collection_count(&sl->clients) == 0) {
+			collection_remove(&serial_index, sl);
+			collection_free(&sl->clients);
+			free(sl->serial);
+			free(sl);
+		}
+	} ENDFOREACH
+	FOREACH(struct device_listeners *dl, &device_index) {
+		if(listener_in(&dl->clients, client))
+			collection_remove(&dl->clients, client);
+	} ENDFOREACH
+	FOREACH(struct pending_event *pe, &pending_events) {
+		if(listener_in(&pe->clients, client))
+			collection_remove(&pe->clients, client);
+	} ENDFOREACH
+}
+
+/**
+ * Record a device that became visible, with the listeners it matches.
+ * client_list_mutex must be held.
+ */
+static struct device_listeners *device_index_add(struct device_info *dev)
+{
+	struct device_listeners *dl = device_index_find(dev->id);
+	struct serial_listeners *sl;
+
+	if(!dl) {
+		dl = malloc(sizeof(struct device_listeners));
+		dl->device_id = dev->id;
+		dl->info = *dev;
+		dl->info.serial = strdup(dev->serial);
+		collection_init(&dl->clients);
+		collection_add(&device_index, dl);
+	}
+	FOREACH(struct mux_client *lc, &any_listeners) {
+		if(listen_filter_matches(lc->filter, dev) && !listener_in(&dl->clients, lc))
+			collection_add(&dl->clients, lc);
+	} ENDFOREACH
+	sl = serial_index_find(dev->serial);
+	if(sl) {
+		FOREACH(struct mux_client *lc, &sl->clients) {
+			if(listen_filter_matches(lc->filter, dev) && !listener_in(&dl->clients, lc))
+				collection_add(&dl->clients, lc);
+		} ENDFOREACH
+	}
+	return dl;
+}
+
+static void device_index_free(struct device_listeners *dl)
+{
+	free((char*)dl->info.serial);
+	collection_free(&dl->clients);
+	free(dl);
+}
+
 void client_close(struct mux_client *client)
 {
 	pthread_mutex_lock(&client_list_mutex);
@@ -290,8 +744,20 @@ void client_close(struct mux_client *client)
 		client->state = CLIENT_DEAD;
 		device_abort_connect(client->connect_device, client);
 	}
+	if(client->state == CLIENT_LISTEN)
+		listener_unregister(client);
+	listen_filter_free(client->filter);
+	plist_free(client->batch);
 	close(client->fd);
-	free(client->ob_buf);
+	pthread_mutex_lock(&client->ob_mutex);
+	while(client->ob_head) {
+		struct out_segment *seg = client->ob_head;
+		client->ob_head = seg->next;
+		shared_msg_unref(seg->msg);
+		free(seg);
+	}
+	pthread_mutex_unlock(&client->ob_mutex);
+	pthread_mutex_destroy(&client->ob_mutex);
 	free(client->ib_buf);
 	plist_free(client->info);
 
@@ -304,54 +770,132 @@ void client_get_fds(struct fdlist *list)
 {
 	pthread_mutex_lock(&client_list_mutex);
 	FOREACH(struct mux_client *client, &client_list) {
-		fdlist_add_client_fd(list, client->fd, client->events);
+		short events = client->events;
+		// the socket is writable, so this wakes the loop up to pass
+		// payload left in ib_buf to a connection that can take it
+		if(client->state == CLIENT_CONNECTED && client->ib_size && (events & POLLIN))
+			events |= POLLOUT;
+		fdlist_add_client_fd(list, client->fd, events);
 	} ENDFOREACH
 	pthread_mutex_unlock(&client_list_mutex);
+	if(batch_wakeup[0] >= 0)
+		fdlist_add_client_fd(list, batch_wakeup[0], POLLIN);
+}
+
+/**
+ * Append a message to the client's output chain. The chain only holds a
+ * reference, so a message broadcast to many clients is stored once.
+ *
+ * A client that lets more than CLIENT_OUTPUT_MAX bytes pile up is not
+ * reading; nothing it is sent can be dropped without desynchronizing the
+ * protocol, so it is disconnected instead. A listener that reconnects
+ * gets the current device list again. Shutting down the socket wakes up
+ * the main loop, which closes the client when it reads EOF.
+ */
+static int output_queue(struct mux_client *client, struct shared_msg *smsg)
+{
+	int res = smsg->length;
+
+	pthread_mutex_lock(&client->ob_mutex);
+	if(client->ob_overflow) {
+		res = -1;
+	} else if(client->ob_size + smsg->length > CLIENT_OUTPUT_MAX) {
+		usbmuxd_log(LL_WARNING, "Client %d is not reading its output (%d bytes pending), disconnecting", client->fd, client->ob_size);
+		client->ob_overflow = 1;
+		shutdown(client->fd, SHUT_RDWR);
+		res = -1;
+	} else {
+		struct out_segment *seg = malloc(sizeof(struct out_segment));
+		if(!seg) {
+			res = -1;
+		} else {
+			__sync_add_and_fetch(&smsg->refcount, 1);
+			seg->msg = smsg;
+			seg->offset = 0;
+			seg->next = NULL;
+			if(client->ob_tail)
+				client->ob_tail->next = seg;
+			else
+				client->ob_head = seg;
+			client->ob_tail = seg;
+			client->ob_size += smsg->length;
+			client->events |= POLLOUT;
+		}
+	}
+	pthread_mutex_unlock(&client->ob_mutex);
+	return res;
 }
 
 static int output_buffer_add_message(struct mux_client *client, uint32_t tag, enum usbmuxd_msgtype msg, void *payload, int payload_length)
 {
-	struct usbmuxd_header hdr;
-	hdr.version = client->proto_version;
-	hdr.length = sizeof(hdr) + payload_length;
-	hdr.message = msg;
-	hdr.tag = tag;
+	struct shared_msg *smsg;
+	int res;
+
 	usbmuxd_log(LL_DEBUG, "Client %d output buffer got tag %d msg %d payload_length %d", client->fd, tag, msg, payload_length);
+	smsg = shared_msg_new(client->proto_version, tag, msg, payload, payload_length);
+	res = output_queue(client, smsg);
+	shared_msg_unref(smsg);
+	return res;
+}
+
+static void encoded_plist_free(struct encoded_plist *enc)
+{
+	int i;
+	for (i = 0; i < PLIST_NUM_FORMATS; i++) {
+		free(enc->data[i]);
+		enc->data[i] = NULL;
+		enc->size[i] = 0;
+	}
+	plist_free(enc->plist);
+	enc->plist = NULL;
+}
 
-	uint32_t available = client->ob_capacity - client->ob_size;
-	/* the output buffer _should_ be large enough, but just in case */
-	if(available < hdr.length) {
-		unsigned char* new_buf;
-		uint32_t new_size = ((client->ob_capacity + hdr.length + 4096) / 4096) * 4096;
-		usbmuxd_log(LL_DEBUG, "%s: Enlarging client %d output buffer %d -> %d", __func__, client->fd, client->ob_capacity, new_size);
-		new_buf = realloc(client->ob_buf, new_size);
-		if (!new_buf) {
-			usbmuxd_log(LL_FATAL, "%s: Failed to realloc.", __func__);
+static int encode_plist(struct encoded_plist *enc, enum plist_format format)
+{
+	struct plist_format_stats *stats = &format_stats[format];
+
+	if (enc->data[format]) {
+		pthread_mutex_lock(&format_stats_mutex);
+		stats->reused++;
+		pthread_mutex_unlock(&format_stats_mutex);
+	} else {
+		uint64_t start = ustime64();
+		if (format == PLIST_FORMAT_BINARY)
+			plist_to_bin(enc->plist, &enc->data[format], &enc->size[format]);
+		else
+			plist_to_xml(enc->plist, &enc->data[format], &enc->size[format]);
+		if (!enc->data[format]) {
+			usbmuxd_log(LL_ERROR, "%s: Could not convert plist to %s", __func__, (format == PLIST_FORMAT_BINARY) ? "binary" : "xml");
 			return -1;
 		}
-		client->ob_buf = new_buf;
-		client->ob_capacity = new_size;
+		uint64_t elapsed = ustime64() - start;
+		pthread_mutex_lock(&format_stats_mutex);
+		stats->encoded++;
+		stats->encoded_bytes += enc->size[format];
+		stats->encode_time += elapsed;
+		pthread_mutex_unlock(&format_stats_mutex);
 	}
-	memcpy(client->ob_buf + client->ob_size, &hdr, sizeof(hdr));
-	if(payload && payload_length)
-		memcpy(client->ob_buf + client->ob_size + sizeof(hdr), payload, payload_length);
-	client->ob_size += hdr.length;
-	client->events |= POLLOUT;
-	return hdr.length;
+	return 0;
+}
+
+static int send_encoded_plist(struct mux_client *client, uint32_t tag, struct encoded_plist *enc)
+{
+	enum plist_format format = client->binary_plist ? PLIST_FORMAT_BINARY : PLIST_FORMAT_XML;
+	if (encode_plist(enc, format) < 0)
+		return -1;
+	return output_buffer_add_message(client, tag, MESSAGE_PLIST, enc->data[format], enc->size[format]);
 }
 
 static int send_plist(struct mux_client *client, uint32_t tag, plist_t plist)
 {
-	int res = -1;
-	char *xml = NULL;
-	uint32_t xmlsize = 0;
-	plist_to_xml(plist, &xml, &xmlsize);
-	if (xml) {
-		res = output_buffer_add_message(client, tag, MESSAGE_PLIST, xml, xmlsize);
-		free(xml);
-	} else {
-		usbmuxd_log(LL_ERROR, "%s: Could not convert plist to xml", __func__);
-	}
+	struct encoded_plist enc;
+	int res;
+
+	memset(&enc, 0, sizeof(enc));
+	enc.plist = plist;
+	res = send_encoded_plist(client, tag, &enc);
+	enc.plist = NULL; // owned by the caller
+	encoded_plist_free(&enc);
 	return res;
 }
 
@@ -380,6 +924,8 @@ static int send_bad_command(struct mux_client *client, uint32_t tag)
 	return 0;
 }
 
+static int input_buffer_dispatch(struct mux_client *client);
+
 int client_notify_connect(struct mux_client *client, enum usbmuxd_result result)
 {
 	usbmuxd_log(LL_SPEW, "client_notify_connect fd %d result %d", client->fd, result);
@@ -394,11 +940,18 @@ int client_notify_connect(struct mux_client *client, enum usbmuxd_result result)
 	if(result == RESULT_OK) {
 		client->state = CLIENT_CONNECTING2;
 		client->events = POLLOUT; // wait for the result packet to go through
-		// no longer need this
-		free(client->ib_buf);
-		client->ib_buf = NULL;
+		// no longer need this, unless the client sent payload early
+		if(!client->ib_size) {
+			free(client->ib_buf);
+			client->ib_buf = NULL;
+			client->ib_capacity = 0;
+		}
 	} else {
 		client->state = CLIENT_COMMAND;
+		client->events |= POLLIN;
+		// commands pipelined behind the Connect would wait for more input
+		if(client->ib_size >= sizeof(struct usbmuxd_header))
+			input_buffer_dispatch(client);
 	}
 	return 0;
 }
@@ -419,30 +972,51 @@ static plist_t create_device_attached_plist(struct device_info *dev)
 	return dict;
 }
 
-static int send_device_list(struct mux_client *client, uint32_t tag)
+// list_cache_mutex must be held
+static void list_cache_clear(void)
 {
-	int res = -1;
-	plist_t dict = plist_new_dict();
-	plist_t devices = plist_new_array();
+	int i;
+	if (!list_cache.snap)
+		return;
+	for (i = 0; i < list_cache.snap->visible; i++)
+		encoded_plist_free(&list_cache.attached[i]);
+	free(list_cache.attached);
+	list_cache.attached = NULL;
+	encoded_plist_free(&list_cache.list);
+	device_snapshot_put(list_cache.snap);
+	list_cache.snap = NULL;
+}
 
-	struct device_info *devs = NULL;
-	struct device_info *dev;
+// list_cache_mutex must be held
+static void list_cache_update(void)
+{
+	struct device_snapshot *snap = device_snapshot_get();
+	plist_t devices;
 	int i;
 
-	int count = device_get_list(0, &devs);
-	dev = devs;
-	for (i = 0; devs && i < count; i++) {
-		plist_t device = create_device_attached_plist(dev++);
-		if (device) {
-			plist_array_append_item(devices, device);
-		}
+	if (list_cache.snap && list_cache.snap->generation == snap->generation) {
+		device_snapshot_put(snap);
+		return;
+	}
+	list_cache_clear();
+	list_cache.snap = snap;
+	list_cache.attached = calloc(snap->visible ? snap->visible : 1, sizeof(struct encoded_plist));
+	devices = plist_new_array();
+	for (i = 0; i < snap->visible; i++) {
+		list_cache.attached[i].plist = create_device_attached_plist(&snap->devices[i]);
+		plist_array_append_item(devices, plist_copy(list_cache.attached[i].plist));
 	}
-	if (devs)
-		free(devs);
+	list_cache.list.plist = plist_new_dict();
+	plist_dict_set_item(list_cache.list.plist, "DeviceList", devices);
+}
 
-	plist_dict_set_item(dict, "DeviceList", devices);
-	res = send_plist(client, tag, dict);
-	plist_free(dict);
+static int send_device_list(struct mux_client *client, uint32_t tag)
+{
+	int res;
+	pthread_mutex_lock(&list_cache_mutex);
+	list_cache_update();
+	res = send_encoded_plist(client, tag, &list_cache.list);
+	pthread_mutex_unlock(&list_cache_mutex);
 	return res;
 }
 
@@ -524,6 +1098,182 @@ static int send_system_buid(struct mux_client *client, uint32_t tag)
 	return res;
 }
 
+static plist_t create_histogram_plist(const uint64_t *buckets)
+{
+	plist_t array = plist_new_array();
+	int i, last = 0;
+	// trailing empty buckets are left out
+	for (i = 0; i < USB_STATS_BUCKETS; i++) {
+		if (buckets[i])
+			last = i + 1;
+	}
+	for (i = 0; i < last; i++) {
+		plist_array_append_item(array, plist_new_uint(buckets[i]));
+	}
+	return array;
+}
+
+static plist_t create_xfer_stats_plist(struct usb_xfer_stats *stats)
+{
+	static const char *status_names[USB_STATS_NUM_STATUS] = {
+		"Completed", "Error", "TimedOut", "Cancelled", "Stall", "NoDevice", "Overflow"
+	};
+	plist_t dict = plist_new_dict();
+	plist_t status = plist_new_dict();
+	int i;
+
+	plist_dict_set_item(dict, "Transfers", plist_new_uint(stats->transfers));
+	plist_dict_set_item(dict, "Bytes", plist_new_uint(stats->bytes));
+	plist_dict_set_item(dict, "Recoveries", plist_new_uint(stats->recoveries));
+	for (i = 0; i < USB_STATS_NUM_STATUS; i++) {
+		plist_dict_set_item(status, status_names[i], plist_new_uint(stats->status[i]));
+	}
+	plist_dict_set_item(dict, "Status", status);
+	plist_dict_set_item(dict, "LatencyHistogram", create_histogram_plist(stats->latency));
+	plist_dict_set_item(dict, "SizeHistogram", create_histogram_plist(stats->size));
+	plist_dict_set_item(dict, "DepthHistogram", create_histogram_plist(stats->depth));
+	return dict;
+}
+
+static plist_t create_format_stats_plist(void)
+{
+	static const char *format_names[PLIST_NUM_FORMATS] = { "XML", "Binary" };
+	struct plist_format_stats stats[PLIST_NUM_FORMATS];
+	plist_t dict = plist_new_dict();
+	int i;
+
+	pthread_mutex_lock(&format_stats_mutex);
+	memcpy(stats, format_stats, sizeof(stats));
+	pthread_mutex_unlock(&format_stats_mutex);
+	for (i = 0; i < PLIST_NUM_FORMATS; i++) {
+		plist_t format = plist_new_dict();
+		plist_dict_set_item(format, "Encoded", plist_new_uint(stats[i].encoded));
+		plist_dict_set_item(format, "EncodedBytes", plist_new_uint(stats[i].encoded_bytes));
+		plist_dict_set_item(format, "EncodeTime", plist_new_uint(stats[i].encode_time));
+		plist_dict_set_item(format, "Reused", plist_new_uint(stats[i].reused));
+		plist_dict_set_item(format, "Decoded", plist_new_uint(stats[i].decoded));
+		plist_dict_set_item(format, "DecodedBytes", plist_new_uint(stats[i].decoded_bytes));
+		plist_dict_set_item(format, "DecodeTime", plist_new_uint(stats[i].decode_time));
+		plist_dict_set_item(format, "Scanned", plist_new_uint(stats[i].scanned));
+		plist_dict_set_item(format, "ScanTime", plist_new_uint(stats[i].scan_time));
+		plist_dict_set_item(format, "ScanFallbacks", plist_new_uint(stats[i].scan_fallbacks));
+		plist_dict_set_item(dict, format_names[i], format);
+	}
+	return dict;
+}
+
+/**
+ * Reply to ReadStatistics with the USB transfer statistics of all
+ * attached devices. Histograms are arrays of log2 buckets, see
+ * struct usb_xfer_stats.
+ */
+static int send_statistics(struct mux_client *client, uint32_t tag)
+{
+	int res = -1;
+	plist_t dict = plist_new_dict();
+	plist_t devices = plist_new_array();
+	struct usb_cache_stats cache_stats;
+	struct usb_xfer_stats rx, tx;
+	struct usb_bus_stats *buses = NULL;
+	const char *transport = NULL;
+	struct rusage usage;
+
+	struct device_snapshot *snap = device_snapshot_get();
+	struct device_info *dev;
+	int count, i;
+
+	dev = snap->devices;
+	for (i = 0; i < snap->count; i++, dev++) {
+		if (device_get_usb_stats(dev->id, &transport, &rx, &tx) < 0)
+			continue;
+		plist_t device = plist_new_dict();
+		plist_dict_set_item(device, "DeviceID", plist_new_uint(dev->id));
+		plist_dict_set_item(device, "SerialNumber", plist_new_string(dev->serial));
+		plist_dict_set_item(device, "Transport", plist_new_string(transport));
+		plist_dict_set_item(device, "RX", create_xfer_stats_plist(&rx));
+		plist_t txdict = create_xfer_stats_plist(&tx);
+		plist_dict_set_item(txdict, "InFlightBytes", plist_new_uint(tx.in_flight_bytes));
+		plist_dict_set_item(txdict, "QueuedBytes", plist_new_uint(tx.queued_bytes));
+		plist_dict_set_item(txdict, "QueuedPeak", plist_new_uint(tx.queued_peak));
+		plist_dict_set_item(txdict, "Throttled", plist_new_uint(tx.throttled));
+		plist_dict_set_item(device, "TX", txdict);
+		plist_array_append_item(devices, device);
+	}
+	device_snapshot_put(snap);
+	plist_dict_set_item(dict, "DeviceList", devices);
+
+	count = usb_bus_get_stats(&buses);
+	plist_t buslist = plist_new_array();
+	for (i = 0; i < count; i++) {
+		plist_t bus = plist_new_dict();
+		plist_t members = plist_new_array();
+		int j;
+		plist_dict_set_item(bus, "Name", plist_new_string(buses[i].name));
+		plist_dict_set_item(bus, "Speed", plist_new_uint(buses[i].speed));
+		plist_dict_set_item(bus, "RXBytes", plist_new_uint(buses[i].rx_bytes));
+		plist_dict_set_item(bus, "TXBytes", plist_new_uint(buses[i].tx_bytes));
+		plist_dict_set_item(bus, "Throughput", plist_new_uint(buses[i].throughput));
+		plist_dict_set_item(bus, "Utilization", plist_new_uint(buses[i].utilization));
+		for (j = 0; j < buses[i].num_members; j++) {
+			struct usb_bus_member_stats *m = &buses[i].members[j];
+			plist_t member = plist_new_dict();
+			plist_dict_set_item(member, "SerialNumber", plist_new_string(m->serial));
+			plist_dict_set_item(member, "Weight", plist_new_uint(m->weight));
+			plist_dict_set_item(member, "TXLimit", plist_new_uint(m->tx_limit));
+			plist_dict_set_item(member, "InFlightBytes", plist_new_uint(m->in_flight_bytes));
+			plist_dict_set_item(member, "RXTransfers", plist_new_uint(m->rx_transfers));
+			plist_array_append_item(members, member);
+		}
+		plist_dict_set_item(bus, "Devices", members);
+		plist_array_append_item(buslist, bus);
+	}
+	usb_bus_free_stats(buses, count);
+	plist_dict_set_item(dict, "Buses", buslist);
+
+	usb_cache_get_stats(&cache_stats);
+	plist_t cache = plist_new_dict();
+	plist_dict_set_item(cache, "Hits", plist_new_uint(cache_stats.hits));
+	plist_dict_set_item(cache, "Misses", plist_new_uint(cache_stats.misses));
+	plist_dict_set_item(cache, "Invalidations", plist_new_uint(cache_stats.invalidations));
+	plist_dict_set_item(dict, "AttachCache", cache);
+
+	plist_dict_set_item(dict, "PlistFormats", create_format_stats_plist());
+
+	// memory held for clients; shared output segments count once per client
+	uint64_t input_bytes = 0, output_bytes = 0;
+	pthread_mutex_lock(&client_list_mutex);
+	plist_t buffers = plist_new_dict();
+	plist_dict_set_item(buffers, "Clients", plist_new_uint(collection_count(&client_list)));
+	FOREACH(struct mux_client *lc, &client_list) {
+		input_bytes += lc->ib_capacity;
+		output_bytes += lc->ob_size;
+	} ENDFOREACH
+	pthread_mutex_unlock(&client_list_mutex);
+	plist_dict_set_item(buffers, "InputBytes", plist_new_uint(input_bytes));
+	plist_dict_set_item(buffers, "OutputBytes", plist_new_uint(output_bytes));
+	plist_dict_set_item(dict, "ClientBuffers", buffers);
+
+	plist_t batching = plist_new_dict();
+	pthread_mutex_lock(&client_list_mutex);
+	plist_dict_set_item(batching, "Window", plist_new_uint(event_batch_ms));
+	plist_dict_set_item(batching, "Batches", plist_new_uint(batch_flushes));
+	plist_dict_set_item(batching, "Events", plist_new_uint(batch_events));
+	pthread_mutex_unlock(&client_list_mutex);
+	plist_dict_set_item(dict, "EventBatching", batching);
+
+	// CPU time spent so far, to relate to the bytes moved by each transport
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		plist_t cpu = plist_new_dict();
+		plist_dict_set_item(cpu, "User", plist_new_uint((uint64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec));
+		plist_dict_set_item(cpu, "System", plist_new_uint((uint64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec));
+		plist_dict_set_item(dict, "CPUTime", cpu);
+	}
+
+	res = send_plist(client, tag, dict);
+	plist_free(dict);
+	return res;
+}
+
 static int send_pair_record(struct mux_client *client, uint32_t tag, const char* record_id)
 {
 	int res = -1;
@@ -548,80 +1298,316 @@ static int send_pair_record(struct mux_client *client, uint32_t tag, const char*
 	return res;
 }
 
-static int send_device_add(struct mux_client *client, struct device_info *dev)
+static void fill_device_record(struct usbmuxd_device_record *dmsg, struct device_info *dev)
+{
+	memset(dmsg, 0, sizeof(*dmsg));
+	dmsg->device_id = dev->id;
+	strncpy(dmsg->serial_number, dev->serial, 256);
+	dmsg->serial_number[255] = 0;
+	dmsg->location = dev->location;
+	dmsg->product_id = dev->pid;
+}
+
+static int send_device_add(struct mux_client *client, struct device_info *dev, struct encoded_plist *attached)
 {
 	int res = -1;
 	if (client->proto_version == 1) {
 		/* XML plist packet */
-		plist_t dict = create_device_attached_plist(dev);
-		res = send_plist(client, 0, dict);
-		plist_free(dict);
+		res = send_encoded_plist(client, 0, attached);
 	} else {
 		/* binary packet */
 		struct usbmuxd_device_record dmsg;
-		memset(&dmsg, 0, sizeof(dmsg));
-		dmsg.device_id = dev->id;
-		strncpy(dmsg.serial_number, dev->serial, 256);
-		dmsg.serial_number[255] = 0;
-		dmsg.location = dev->location;
-		dmsg.product_id = dev->pid;
+		fill_device_record(&dmsg, dev);
 		res = output_buffer_add_message(client, 0, MESSAGE_DEVICE_ADD, &dmsg, sizeof(dmsg));
 	}
 	return res;
 }
 
-static int send_message(struct mux_client *client, enum usbmuxd_msgtype msg, const char *type, uint32_t device_id)
+static struct shared_msg *device_event_get(struct device_event *ev, struct mux_client *client)
 {
-	int res = -1;
-	if (client->proto_version == 1) {
-		/* XML plist packet */
+	enum event_flavour flavour;
+	enum plist_format format;
+
+	if (client->proto_version != 1)
+		flavour = EVENT_BINARY;
+	else
+		flavour = client->binary_plist ? EVENT_BPLIST : EVENT_XML;
+	if (ev->encoded[flavour]) {
+		if (flavour != EVENT_BINARY) {
+			pthread_mutex_lock(&format_stats_mutex);
+			format_stats[(flavour == EVENT_BPLIST) ? PLIST_FORMAT_BINARY : PLIST_FORMAT_XML].reused++;
+			pthread_mutex_unlock(&format_stats_mutex);
+		}
+		return ev->encoded[flavour];
+	}
+	if (flavour == EVENT_BINARY) {
+		ev->encoded[flavour] = shared_msg_new(0, 0, ev->msg, ev->payload, ev->payload_length);
+	} else {
+		format = (flavour == EVENT_BPLIST) ? PLIST_FORMAT_BINARY : PLIST_FORMAT_XML;
+		if (encode_plist(&ev->plist, format) < 0)
+			return NULL;
+		ev->encoded[flavour] = shared_msg_new(1, 0, MESSAGE_PLIST, ev->plist.data[format], ev->plist.size[format]);
+	}
+	return ev->encoded[flavour];
+}
+
+// takes over plist, client_list_mutex must be held
+static void journal_add(int event, struct device_info *info, struct encoded_plist *plist)
+{
+	struct journal_entry *entry = &journal[event_seq % EVENT_JOURNAL_SIZE];
+	free((char*)entry->info.serial);
+	encoded_plist_free(&entry->plist);
+	entry->event = event;
+	entry->info = *info;
+	entry->info.serial = strdup(info->serial);
+	entry->plist = *plist;
+	memset(plist, 0, sizeof(*plist));
+}
+
+// whether every event after since is still in the journal
+static int journal_covers(uint64_t since)
+{
+	return since >= journal_start && since <= event_seq && event_seq - since <= EVENT_JOURNAL_SIZE;
+}
+
+static void journal_free(void)
+{
+	int i;
+	for (i = 0; i < EVENT_JOURNAL_SIZE; i++) {
+		free((char*)journal[i].info.serial);
+		journal[i].info.serial = NULL;
+		encoded_plist_free(&journal[i].plist);
+	}
+}
+
+/**
+ * Queue a device event to the listeners of dl that want this type of
+ * event. It is encoded once per protocol flavour and the listeners share
+ * the resulting buffers. Plist events are stamped with the next sequence
+ * number and kept in the journal.
+ * client_list_mutex must be held.
+ */
+static void broadcast_device_event(struct device_event *ev, struct device_listeners *dl, int event)
+{
+	int i;
+	event_seq++;
+	plist_dict_set_item(ev->plist.plist, "EventSequence", plist_new_uint(event_seq));
+	if (event_batch_ms > 0) {
+		struct pending_event *pe = malloc(sizeof(struct pending_event));
+		memset(pe, 0, sizeof(struct pending_event));
+		pe->ev.msg = ev->msg;
+		memcpy(pe->payload, ev->payload, ev->payload_length);
+		pe->ev.payload = pe->payload;
+		pe->ev.payload_length = ev->payload_length;
+		pe->ev.plist.plist = plist_copy(ev->plist.plist);
+		collection_init(&pe->clients);
+		FOREACH(struct mux_client *client, &dl->clients) {
+			if (client->state == CLIENT_LISTEN && listen_filter_wants(client->filter, event))
+				collection_add(&pe->clients, client);
+		} ENDFOREACH
+		collection_add(&pending_events, pe);
+		pthread_cond_signal(&batch_cond);
+		journal_add(event, &dl->info, &ev->plist);
+		return;
+	}
+	FOREACH(struct mux_client *client, &dl->clients) {
+		if (client->state != CLIENT_LISTEN || !listen_filter_wants(client->filter, event))
+			continue;
+		struct shared_msg *smsg = device_event_get(ev, client);
+		if (smsg)
+			output_queue(client, smsg);
+	} ENDFOREACH
+	for (i = 0; i < NUM_EVENT_FLAVOURS; i++) {
+		if (ev->encoded[i])
+			shared_msg_unref(ev->encoded[i]);
+	}
+	journal_add(event, &dl->info, &ev->plist);
+}
+
+static void pending_event_free(struct pending_event *pe)
+{
+	int i;
+	for (i = 0; i < NUM_EVENT_FLAVOURS; i++) {
+		if (pe->ev.encoded[i])
+			shared_msg_unref(pe->ev.encoded[i]);
+	}
+	encoded_plist_free(&pe->ev.plist);
+	collection_free(&pe->clients);
+	free(pe);
+}
+
+// client_list_mutex must be held
+static void flush_pending_events(void)
+{
+	FOREACH(struct pending_event *pe, &pending_events) {
+		FOREACH(struct mux_client *client, &pe->clients) {
+			if (client->accept_batches) {
+				if (!client->batch)
+					client->batch = plist_new_array();
+				plist_array_append_item(client->batch, plist_copy(pe->ev.plist.plist));
+			} else {
+				struct shared_msg *smsg = device_event_get(&pe->ev, client);
+				if (smsg)
+					output_queue(client, smsg);
+			}
+		} ENDFOREACH
+		batch_events++;
+		collection_remove(&pending_events, pe);
+		pending_event_free(pe);
+	} ENDFOREACH
+	FOREACH(struct mux_client *client, &client_list) {
+		if (!client->batch)
+			continue;
 		plist_t dict = plist_new_dict();
-		plist_dict_set_item(dict, "MessageType", plist_new_string(type));
-		plist_dict_set_item(dict, "DeviceID", plist_new_uint(device_id));
-		res = send_plist(client, 0, dict);
+		plist_dict_set_item(dict, "MessageType", plist_new_string("AttachedBatch"));
+		plist_dict_set_item(dict, "Events", client->batch);
+		client->batch = NULL;
+		send_plist(client, 0, dict);
 		plist_free(dict);
+	} ENDFOREACH
+	batch_flushes++;
+}
+
+static void *event_batch_thread(void *arg)
+{
+	pthread_mutex_lock(&client_list_mutex);
+	while (!batch_quit) {
+		if (collection_count(&pending_events) == 0) {
+			pthread_cond_wait(&batch_cond, &client_list_mutex);
+			continue;
+		}
+		// the window opens with the first event
+		pthread_mutex_unlock(&client_list_mutex);
+		usleep(event_batch_ms * 1000);
+		pthread_mutex_lock(&client_list_mutex);
+		flush_pending_events();
+		if (write(batch_wakeup[1], "", 1) < 0 && errno != EAGAIN) {
+			usbmuxd_log(LL_ERROR, "%s: Could not notify main thread: %s", __func__, strerror(errno));
+		}
 	}
-	else {
-		/* binary packet */
-		res = output_buffer_add_message(client, 0, msg, &device_id, sizeof(uint32_t));
+	pthread_mutex_unlock(&client_list_mutex);
+	return NULL;
+}
+
+static void batch_wakeup_close(void)
+{
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (batch_wakeup[i] >= 0)
+			close(batch_wakeup[i]);
+		batch_wakeup[i] = -1;
 	}
-	return res;
 }
 
-static int send_device_remove(struct mux_client *client, uint32_t device_id)
+/**
+ * Hold device events for msec milliseconds after the first one of a
+ * burst and deliver them together. Must be called before client_init().
+ */
+void client_set_event_batch(int msec)
+{
+	event_batch_ms = msec;
+}
+
+// client_list_mutex must be held
+static void broadcast_device_message(struct device_listeners *dl, int event, enum usbmuxd_msgtype msg, const char *type, uint32_t device_id)
 {
-	return send_message(
-		client, MESSAGE_DEVICE_REMOVE, "Detached", device_id);
+	struct device_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.msg = msg;
+	ev.payload = &device_id;
+	ev.payload_length = sizeof(uint32_t);
+	ev.plist.plist = plist_new_dict();
+	plist_dict_set_item(ev.plist.plist, "MessageType", plist_new_string(type));
+	plist_dict_set_item(ev.plist.plist, "DeviceID", plist_new_uint(device_id));
+	broadcast_device_event(&ev, dl, event);
 }
 
-static int send_device_paired(struct mux_client *client, uint32_t device_id)
+static int send_listen_result(struct mux_client *client, uint32_t tag, int resume, int resumed)
 {
-	return send_message(
-		client, MESSAGE_DEVICE_PAIRED, "Paired", device_id);
+	int res;
+	if (client->proto_version != 1)
+		return send_result(client, tag, RESULT_OK);
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "MessageType", plist_new_string("Result"));
+	plist_dict_set_item(dict, "Number", plist_new_uint(RESULT_OK));
+	plist_dict_set_item(dict, "EventSequence", plist_new_uint(event_seq));
+	if (resume)
+		plist_dict_set_item(dict, "Resumed", plist_new_bool(resumed));
+	res = send_plist(client, tag, dict);
+	plist_free(dict);
+	return res;
 }
 
-static int start_listen(struct mux_client *client, struct usbmuxd_header *hdr)
+/**
+ * Make a client a listener. It is sent an Attached message for every
+ * device, unless since is given and the journal still has every event
+ * after it; then only those events are replayed.
+ *
+ * @param since last event sequence number the client saw, or NULL
+ */
+static int start_listen(struct mux_client *client, struct usbmuxd_header *hdr, struct listen_filter *filter, const uint64_t *since)
 {
-	struct device_info *devs = NULL;
-	struct device_info *dev;
-	int count, i;
+	int count = 0, i;
+	int resumed;
+	uint64_t seq;
 
-	if(send_result(client, hdr->tag, 0) < 0)
+	// register first, so devices attached from here on reach the client
+	pthread_mutex_lock(&client_list_mutex);
+	resumed = since && journal_covers(*since);
+	if(send_listen_result(client, hdr->tag, since != NULL, resumed) < 0) {
+		pthread_mutex_unlock(&client_list_mutex);
+		listen_filter_free(filter);
 		return -1;
-
-	usbmuxd_log(LL_DEBUG, "Client %d now LISTENING", client->fd);
+	}
+	usbmuxd_log(LL_DEBUG, "Client %d now LISTENING%s%s", client->fd, filter ? " with a filter" : "", resumed ? ", resumed" : "");
+	client->filter = filter;
 	client->state = CLIENT_LISTEN;
+	listener_register(client);
+	if(resumed) {
+		// the client knows the devices attached before since
+		FOREACH(struct device_listeners *dl, &device_index) {
+			if(listen_filter_has_serial(filter, dl->info.serial) && listen_filter_matches(filter, &dl->info))
+				collection_add(&dl->clients, client);
+		} ENDFOREACH
+		for(seq = *since + 1; seq <= event_seq; seq++) {
+			struct journal_entry *entry = &journal[seq % EVENT_JOURNAL_SIZE];
+			if(!listen_filter_wants(filter, entry->event) || !listen_filter_has_serial(filter, entry->info.serial)
+			   || !listen_filter_matches(filter, &entry->info))
+				continue;
+			if(send_encoded_plist(client, 0, &entry->plist) < 0) {
+				pthread_mutex_unlock(&client_list_mutex);
+				return -1;
+			}
+			count++;
+		}
+		pthread_mutex_unlock(&client_list_mutex);
+		return count;
+	}
+	pthread_mutex_unlock(&client_list_mutex);
 
-	count = device_get_list(0, &devs);
-	dev = devs;
-	for(i=0; devs && i < count; i++) {
-		if(send_device_add(client, dev++) < 0) {
-			free(devs);
+	pthread_mutex_lock(&list_cache_mutex);
+	list_cache_update();
+	pthread_mutex_lock(&client_list_mutex);
+	for(i=0; i < list_cache.snap->visible; i++) {
+		struct device_info *dev = &list_cache.snap->devices[i];
+		struct device_listeners *dl = device_index_find(dev->id);
+		// skip devices detached since the snapshot or already announced
+		if(!dl || listener_in(&dl->clients, client))
+			continue;
+		if(!listen_filter_has_serial(filter, dev->serial) || !listen_filter_matches(filter, dev))
+			continue;
+		collection_add(&dl->clients, client);
+		if(!listen_filter_wants(filter, LISTEN_ATTACHED))
+			continue;
+		if(send_device_add(client, dev, &list_cache.attached[i]) < 0) {
+			pthread_mutex_unlock(&client_list_mutex);
+			pthread_mutex_unlock(&list_cache_mutex);
 			return -1;
 		}
+		count++;
 	}
-	if (devs)
-		free(devs);
+	pthread_mutex_unlock(&client_list_mutex);
+	pthread_mutex_unlock(&list_cache_mutex);
 
 	return count;
 }
@@ -658,6 +1644,37 @@ static void update_client_info(struct mux_client *client, plist_t dict)
 	client->info = info;
 }
 
+static char *scan_strdup(const struct scan_string *str)
+{
+	char *res;
+	if (!str->ptr)
+		return NULL;
+	res = malloc(str->len + 1);
+	memcpy(res, str->ptr, str->len);
+	res[str->len] = '\0';
+	return res;
+}
+
+// like update_client_info(), for a command read by plist_scan_xml()
+static void update_client_info_scanned(struct mux_client *client, struct plist_scan *scan)
+{
+	static const char *keys[SCAN_NUM_STRINGS] = { NULL, "BundleID", "ClientVersionString", "ProgName" };
+	int i;
+
+	plist_t info = plist_new_dict();
+	for (i = SCAN_BUNDLE_ID; i < SCAN_NUM_STRINGS; i++) {
+		char *val = scan_strdup(&scan->strings[i]);
+		if (val) {
+			plist_dict_set_item(info, keys[i], plist_new_string(val));
+			free(val);
+		}
+	}
+	if (scan->have_uints & (1 << SCAN_LIB_USBMUX_VERSION))
+		plist_dict_set_item(info, "kLibUSBMuxVersion", plist_new_uint(scan->uints[SCAN_LIB_USBMUX_VERSION]));
+	plist_free(client->info);
+	client->info = info;
+}
+
 static int start_connect(int device_id, uint16_t port, struct mux_client *client, uint32_t tag)
 {
 	int res;
@@ -674,12 +1691,39 @@ static int start_connect(int device_id, uint16_t port, struct mux_client *client
 	return 0;
 }
 
+static int delete_pair_record(struct mux_client *client, uint32_t tag, const char *record_id)
+{
+	uint32_t rval = RESULT_OK;
+	if (record_id) {
+		int res = config_remove_device_record(record_id);
+		if (res < 0) {
+			rval = -res;
+		}
+	} else {
+		rval = EINVAL;
+	}
+	if (send_result(client, tag, rval) < 0)
+		return -1;
+	return 0;
+}
+
 static int client_process_message(struct mux_client *client, struct usbmuxd_header *hdr, char *message, plist_t dict)
 {
 	int res;
 
 	if (!strcmp(message, "Listen")) {
-		return start_listen(client, hdr);
+		struct listen_filter *filter = NULL;
+		uint64_t since = 0;
+		plist_t node = plist_dict_get_item(dict, "EventSequence");
+		if (node && plist_get_node_type(node) != PLIST_UINT)
+			node = NULL;
+		if (listen_filter_parse(dict, &filter) < 0) {
+			usbmuxd_log(LL_ERROR, "Client %d sent a malformed Listen filter", client->fd);
+			return send_bad_command(client, hdr->tag);
+		}
+		if (node)
+			plist_get_uint_val(node, &since);
+		return start_listen(client, hdr, filter, node ? &since : NULL);
 	} else if (!strcmp(message, "Connect")) {
 		uint64_t val;
 		uint16_t portnum = 0;
@@ -719,6 +1763,10 @@ static int client_process_message(struct mux_client *client, struct usbmuxd_head
 		if (send_system_buid(client, hdr->tag) < 0)
 			return -1;
 		return 0;
+	} else if (!strcmp(message, "ReadStatistics")) {
+		if (send_statistics(client, hdr->tag) < 0)
+			return -1;
+		return 0;
 	} else if (!strcmp(message, "ReadPairRecord")) {
 		char* record_id = plist_dict_get_string_val(dict, "PairRecordID");
 
@@ -751,24 +1799,21 @@ static int client_process_message(struct mux_client *client, struct usbmuxd_head
 					dev_id = (uint32_t)u_dev_id;
 				}
 				if (dev_id > 0) {
-					struct device_info *devs = NULL;
-					struct device_info *dev;
+					struct device_snapshot *snap = device_snapshot_get();
 					int i;
-					int count = device_get_list(1, &devs);
 					int found = 0;
-					dev = devs;
-					for (i = 0; devs && i < count; i++, dev++) {
-						if ((uint32_t)dev->id == dev_id && (strcmp(dev->serial, record_id) == 0)) {
+					for (i = 0; i < snap->count; i++) {
+						if ((uint32_t)snap->devices[i].id == dev_id && (strcmp(snap->devices[i].serial, record_id) == 0)) {
 							found++;
 							break;
 						}
 					}
+					device_snapshot_put(snap);
 					if (!found) {
 						usbmuxd_log(LL_ERROR, "ERROR: SavePairRecord: DeviceID %d (%s) is not connected\n", dev_id, record_id);
 					} else {
 						client_device_paired(dev_id);
 					}
-					free(devs);
 				}
 			}
 			free(record_id);
@@ -780,26 +1825,60 @@ static int client_process_message(struct mux_client *client, struct usbmuxd_head
 			return -1;
 		return 0;
 	} else if (!strcmp(message, "DeletePairRecord")) {
-		uint32_t rval = RESULT_OK;
 		char* record_id = plist_dict_get_string_val(dict, "PairRecordID");
-		if (record_id) {
-			res = config_remove_device_record(record_id);
-			if (res < 0) {
-				rval = -res;
-			}
-			free(record_id);
-		} else {
-			rval = EINVAL;
-		}
-		if (send_result(client, hdr->tag, rval) < 0)
-			return -1;
-		return 0;
+		res = delete_pair_record(client, hdr->tag, record_id);
+		free(record_id);
+		return res;
 	} else {
 		usbmuxd_log(LL_ERROR, "Unexpected command '%s' received!", message);
 		return send_bad_command(client, hdr->tag);
 	}
 }
 
+// client_process_message() for commands read by plist_scan_xml()
+static int client_process_scanned(struct mux_client *client, struct usbmuxd_header *hdr, struct plist_scan *scan)
+{
+	char *record_id;
+	int res;
+
+	switch (scan->command) {
+	case SCAN_LISTEN:
+		return start_listen(client, hdr, NULL, (scan->have_uints & (1 << SCAN_EVENT_SEQUENCE)) ? &scan->uints[SCAN_EVENT_SEQUENCE] : NULL);
+	case SCAN_CONNECT:
+		if (!(scan->have_uints & (1 << SCAN_DEVICE_ID))) {
+			usbmuxd_log(LL_ERROR, "Received connect request without device_id!");
+			if (send_result(client, hdr->tag, RESULT_BADDEV) < 0)
+				return -1;
+			return 0;
+		}
+		if (!(scan->have_uints & (1 << SCAN_PORT_NUMBER))) {
+			usbmuxd_log(LL_ERROR, "Received connect request without port number!");
+			return send_bad_command(client, hdr->tag);
+		}
+		return start_connect((uint32_t)scan->uints[SCAN_DEVICE_ID], (uint16_t)scan->uints[SCAN_PORT_NUMBER], client, hdr->tag);
+	case SCAN_LIST_DEVICES:
+		return (send_device_list(client, hdr->tag) < 0) ? -1 : 0;
+	case SCAN_LIST_LISTENERS:
+		return (send_listener_list(client, hdr->tag) < 0) ? -1 : 0;
+	case SCAN_READ_BUID:
+		return (send_system_buid(client, hdr->tag) < 0) ? -1 : 0;
+	case SCAN_READ_STATISTICS:
+		return (send_statistics(client, hdr->tag) < 0) ? -1 : 0;
+	case SCAN_READ_PAIR_RECORD:
+		record_id = scan_strdup(&scan->strings[SCAN_PAIR_RECORD_ID]);
+		res = send_pair_record(client, hdr->tag, record_id);
+		free(record_id);
+		return (res < 0) ? -1 : 0;
+	case SCAN_DELETE_PAIR_RECORD:
+		record_id = scan_strdup(&scan->strings[SCAN_PAIR_RECORD_ID]);
+		res = delete_pair_record(client, hdr->tag, record_id);
+		free(record_id);
+		return res;
+	default:
+		return send_bad_command(client, hdr->tag);
+	}
+}
+
 static int client_plist_command(struct mux_client *client, struct usbmuxd_header *hdr)
 {
 	char *payload;
@@ -810,13 +1889,59 @@ static int client_plist_command(struct mux_client *client, struct usbmuxd_header
 	payload = (char*)(hdr) + sizeof(struct usbmuxd_header);
 	payload_size = hdr->length - sizeof(struct usbmuxd_header);
 	plist_t dict = NULL;
-	plist_from_xml(payload, payload_size, &dict);
+	struct plist_format_stats *stats;
+	uint64_t start = ustime64();
+	if (payload_size >= 8 && !memcmp(payload, "bplist00", 8)) {
+		// a client that talks binary gets binary replies
+		client->binary_plist = 1;
+		stats = &format_stats[PLIST_FORMAT_BINARY];
+		plist_from_bin(payload, payload_size, &dict);
+	} else {
+		struct plist_scan scan;
+		stats = &format_stats[PLIST_FORMAT_XML];
+		if (plist_scan_xml(payload, payload_size, &scan) == 0) {
+			uint64_t elapsed = ustime64() - start;
+			pthread_mutex_lock(&format_stats_mutex);
+			stats->scanned++;
+			stats->scan_time += elapsed;
+			pthread_mutex_unlock(&format_stats_mutex);
+			if (scan.bools[SCAN_BINARY_PLIST] >= 0)
+				client->binary_plist = scan.bools[SCAN_BINARY_PLIST];
+			if (scan.bools[SCAN_ACCEPT_BATCHES] >= 0)
+				client->accept_batches = scan.bools[SCAN_ACCEPT_BATCHES];
+			update_client_info_scanned(client, &scan);
+			return client_process_scanned(client, hdr, &scan);
+		}
+		pthread_mutex_lock(&format_stats_mutex);
+		stats->scan_fallbacks++;
+		pthread_mutex_unlock(&format_stats_mutex);
+		plist_from_xml(payload, payload_size, &dict);
+	}
 	if (!dict) {
 		usbmuxd_log(LL_ERROR, "Could not parse plist from payload!");
 		return -1;
 	} else {
 		char *message = NULL;
-		plist_t node = plist_dict_get_item(dict, "MessageType");
+		uint64_t elapsed = ustime64() - start;
+		pthread_mutex_lock(&format_stats_mutex);
+		stats->decoded++;
+		stats->decoded_bytes += payload_size;
+		stats->decode_time += elapsed;
+		pthread_mutex_unlock(&format_stats_mutex);
+		// XML clients may ask for binary replies, too
+		plist_t node = plist_dict_get_item(dict, "BinaryPlist");
+		if (node && plist_get_node_type(node) == PLIST_BOOLEAN) {
+			uint8_t binary = 0;
+			plist_get_bool_val(node, &binary);
+			client->binary_plist = binary;
+		}
+		node = plist_dict_get_item(dict, "AcceptBatches");
+		if (node && plist_get_node_type(node) == PLIST_BOOLEAN) {
+			uint8_t accept = 0;
+			plist_get_bool_val(node, &accept);
+			client->accept_batches = accept;
+		}
+		node = plist_dict_get_item(dict, "MessageType");
 		if (plist_get_node_type(node) != PLIST_STRING) {
 			usbmuxd_log(LL_ERROR, "Could not read valid MessageType node from plist!");
 			plist_free(dict);
@@ -831,7 +1956,7 @@ static int client_plist_command(struct mux_client *client, struct usbmuxd_header
 		update_client_info(client, dict);
 		res = client_process_message(client, hdr, message, dict);
 		free(message);
-		free(dict);
+		plist_free(dict);
 		return res;
 	}
 	// should not be reached?!
@@ -863,7 +1988,7 @@ static int handle_command(struct mux_client *client)
 		case MESSAGE_PLIST:
 			return client_plist_command(client, hdr);
 		case MESSAGE_LISTEN:
-			return start_listen(client, hdr);
+			return start_listen(client, hdr, NULL, NULL);
 		case MESSAGE_CONNECT:
 			ch = (void*)hdr;
 			return start_connect(ch->device_id, ch->port, client, hdr->tag);
@@ -876,140 +2001,164 @@ static int handle_command(struct mux_client *client)
 
 static void output_buffer_process(struct mux_client *client)
 {
-	int res;
+	struct iovec iov[OUTPUT_IOV_MAX];
+	struct msghdr mh;
+	struct out_segment *seg;
+	int count = 0;
+	ssize_t res;
+
+	pthread_mutex_lock(&client->ob_mutex);
 	if(!client->ob_size) {
+		pthread_mutex_unlock(&client->ob_mutex);
 		usbmuxd_log(LL_WARNING, "Client %d OUT process but nothing to send?", client->fd);
 		client->events &= ~POLLOUT;
 		return;
 	}
-	res = send(client->fd, client->ob_buf, client->ob_size, 0);
+	for(seg = client->ob_head; seg && count < OUTPUT_IOV_MAX; seg = seg->next) {
+		iov[count].iov_base = seg->msg->data + seg->offset;
+		iov[count].iov_len = seg->msg->length - seg->offset;
+		count++;
+	}
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = count;
+	res = sendmsg(client->fd, &mh, 0);
 	if(res <= 0) {
-		usbmuxd_log(LL_ERROR, "Sending to client fd %d failed: %d %s", client->fd, res, strerror(errno));
+		pthread_mutex_unlock(&client->ob_mutex);
+		usbmuxd_log(LL_ERROR, "Sending to client fd %d failed: %d %s", client->fd, (int)res, strerror(errno));
 		client_close(client);
 		return;
 	}
-	if((uint32_t)res == client->ob_size) {
-		client->ob_size = 0;
+	client->ob_size -= res;
+	while(res > 0) {
+		seg = client->ob_head;
+		if((size_t)res < seg->msg->length - seg->offset) {
+			seg->offset += res;
+			break;
+		}
+		res -= seg->msg->length - seg->offset;
+		client->ob_head = seg->next;
+		shared_msg_unref(seg->msg);
+		free(seg);
+	}
+	if(!client->ob_head) {
+		client->ob_tail = NULL;
 		client->events &= ~POLLOUT;
 		if(client->state == CLIENT_CONNECTING2) {
 			usbmuxd_log(LL_DEBUG, "Client %d switching to CONNECTED state", client->fd);
 			client->state = CLIENT_CONNECTED;
 			client->events = client->devents;
-			// no longer need this
-			free(client->ob_buf);
-			client->ob_buf = NULL;
 		}
-	} else {
-		client->ob_size -= res;
-		memmove(client->ob_buf, client->ob_buf + res, client->ob_size);
 	}
+	pthread_mutex_unlock(&client->ob_mutex);
 }
 
-static int complete(struct mux_client *client, size_t expected_size)
+static int close_client_with_invalid_header(struct mux_client *client)
 {
-	int res = recv(
-		client->fd,
-		client->ib_buf + client->ib_size,
-		expected_size - client->ib_size,
-		0);
-
-	if(res < 0) {
-		usbmuxd_log(LL_ERROR, "Receive from client fd %d failed: %s", client->fd, strerror(errno));
+	struct usbmuxd_header *hdr = (void*)client->ib_buf;
+	if(hdr->length > CMD_BUF_MAX) {
+		usbmuxd_log(LL_INFO, "Client %d message is too long (%d bytes)", client->fd, hdr->length);
 		client_close(client);
-	} else if(res == 0) {
-		usbmuxd_log(LL_INFO, "Client %d connection closed", client->fd);
+		return -1;
+	}
+	if(hdr->length < sizeof(struct usbmuxd_header)) {
+		usbmuxd_log(LL_ERROR, "Client %d message is too short (%d bytes)", client->fd, hdr->length);
 		client_close(client);
-	} else
-		client->ib_size += res;
-	return res;
-}
-
-static int message_incomplete(struct mux_client *client)
-{
-	struct usbmuxd_header *header = (void*)client->ib_buf;
-	return client->ib_size < header->length;
-}
-
-static int complete_message(struct mux_client *client)
-{
-	struct usbmuxd_header *header = (void*)client->ib_buf;
-	uint32_t message_length = header->length;
-	return complete(client, message_length);
-}
-
-static int client_try_complete_message(struct mux_client *client, int did_read)
-{
-	int res;
-	if(message_incomplete(client)) {
-		if(did_read)
-			return -1; //maybe we would block, so defer to next loop
-		res = complete_message(client);
-		if(res <= 0)
-			return -1;
-		else if(message_incomplete(client))
-			return -1;
+		return -1;
 	}
 	return 0;
 }
 
-static int header_incomplete(struct mux_client *client)
+static int input_buffer_resize(struct mux_client *client, uint32_t capacity)
 {
-	return client->ib_size < sizeof(struct usbmuxd_header);
+	unsigned char *new_buf = realloc(client->ib_buf, capacity);
+	if (!new_buf) {
+		usbmuxd_log(LL_ERROR, "%s: Failed to resize client %d input buffer to %d bytes", __func__, client->fd, capacity);
+		return -1;
+	}
+	client->ib_buf = new_buf;
+	client->ib_capacity = capacity;
+	return 0;
 }
 
-static int complete_header(struct mux_client *client)
+/**
+ * Handle every complete command in ib_buf. Bytes that follow a Connect
+ * command are the start of the connection's payload; they stay in ib_buf
+ * until the connection is up, see client_read(), or are handled as
+ * commands if the connection is refused.
+ *
+ * @return 0, or -1 if the client was closed
+ */
+static int input_buffer_dispatch(struct mux_client *client)
 {
-	size_t header_length = sizeof(struct usbmuxd_header);
-	return complete(client, header_length);
-}
+	struct usbmuxd_header *hdr;
+	uint32_t length;
 
-static int client_try_complete_header(struct mux_client *client)
-{
-	int res;
-	if(header_incomplete(client)) {
-		res = complete_header(client);
-		if(res <= 0)
+	while (client->ib_size >= sizeof(struct usbmuxd_header)) {
+		if (close_client_with_invalid_header(client) < 0)
 			return -1;
-		else if(header_incomplete(client))
+		hdr = (void*)client->ib_buf;
+		length = hdr->length;
+		if (length > client->ib_size) {
+			if (length > client->ib_capacity && input_buffer_resize(client, length) < 0) {
+				client_close(client);
+				return -1;
+			}
+			return 0;
+		}
+		if (client->state != CLIENT_COMMAND) {
+			// handle_command() rejects it and closes the client
+			handle_command(client);
 			return -1;
-		else
-			return 1;
-	} else {
-		return 0;
-	}
-}
-
-static int close_client_with_invalid_header(struct mux_client *client)
-{
-	struct usbmuxd_header *hdr = (void*)client->ib_buf;
-	if(hdr->length > client->ib_capacity) {
-		usbmuxd_log(LL_INFO, "Client %d message is too long (%d bytes)", client->fd, hdr->length);
-		client_close(client);
-		return -1;
-	}
-	if(hdr->length < sizeof(struct usbmuxd_header)) {
-		usbmuxd_log(LL_ERROR, "Client %d message is too short (%d bytes)", client->fd, hdr->length);
-		client_close(client);
-		return -1;
+		}
+		handle_command(client);
+		// keep the next message at the start of the buffer, aligned
+		client->ib_size -= length;
+		memmove(client->ib_buf, client->ib_buf + length, client->ib_size);
+		if (client->state == CLIENT_CONNECTING1) {
+			// wait for the device before reading any payload
+			client->events &= ~POLLIN;
+			return 0;
+		}
 	}
 	return 0;
 }
 
+/**
+ * Read whatever the client has sent and handle every complete command in
+ * it, so a client that pipelines several commands is served in a single
+ * wakeup.
+ */
 static void input_buffer_process(struct mux_client *client)
 {
 	int res;
-	int did_read;
-	did_read = client_try_complete_header(client);
-	if (did_read < 0)
+
+	// (re)allocate the buffer an idle client does not hold
+	if (client->ib_size == 0 && client->ib_capacity != CMD_BUF_INITIAL) {
+		if (input_buffer_resize(client, CMD_BUF_INITIAL) < 0) {
+			client_close(client);
+			return;
+		}
+	}
+	res = recv(client->fd, client->ib_buf + client->ib_size, client->ib_capacity - client->ib_size, 0);
+	if (res < 0) {
+		usbmuxd_log(LL_ERROR, "Receive from client fd %d failed: %s", client->fd, strerror(errno));
+		client_close(client);
 		return;
-	res = close_client_with_invalid_header(client);
-	if (res < 0)
+	} else if (res == 0) {
+		usbmuxd_log(LL_INFO, "Client %d connection closed", client->fd);
+		client_close(client);
 		return;
-	res = client_try_complete_message(client, did_read);
-	if (res < 0)
+	}
+	client->ib_size += res;
+	if (input_buffer_dispatch(client) < 0)
 		return;
-	handle_command(client);
-	client->ib_size = 0;
+	// nothing is buffered between messages, so let go of it until the next
+	if (client->ib_size == 0) {
+		free(client->ib_buf);
+		client->ib_buf = NULL;
+		client->ib_capacity = 0;
+	}
 }
 
 static struct mux_client* find_by_fd(int fd)
@@ -1030,7 +2179,16 @@ static struct mux_client* find_by_fd(int fd)
 
 void client_process(int fd, short events)
 {
-	struct mux_client *client = find_by_fd(fd);
+	struct mux_client *client;
+
+	if(fd == batch_wakeup[0]) {
+		// the next poll picks up the clients the flush queued output for
+		char buf[64];
+		while(read(fd, buf, sizeof(buf)) > 0);
+		return;
+	}
+
+	client = find_by_fd(fd);
 
 	if(!client) {
 		usbmuxd_log(LL_INFO, "client_process: fd %d not found in client list", fd);
@@ -1039,6 +2197,8 @@ void client_process(int fd, short events)
 
 	if(client->state == CLIENT_CONNECTED) {
 		usbmuxd_log(LL_SPEW, "client_process in CONNECTED state");
+		if(client->ib_size && (client->events & POLLIN))
+			events |= POLLIN;
 		device_client_process(client->connect_device, client, events);
 	} else {
 		if(events & POLLIN) {
@@ -1055,10 +2215,15 @@ void client_device_add(struct device_info *dev)
 	pthread_mutex_lock(&client_list_mutex);
 	usbmuxd_log(LL_DEBUG, "client_device_add: id %d, location 0x%x, serial %s", dev->id, dev->location, dev->serial);
 	device_set_visible(dev->id);
-	FOREACH(struct mux_client *client, &client_list) {
-		if(client->state == CLIENT_LISTEN)
-			send_device_add(client, dev);
-	} ENDFOREACH
+	struct usbmuxd_device_record dmsg;
+	struct device_event ev;
+	fill_device_record(&dmsg, dev);
+	memset(&ev, 0, sizeof(ev));
+	ev.msg = MESSAGE_DEVICE_ADD;
+	ev.payload = &dmsg;
+	ev.payload_length = sizeof(dmsg);
+	ev.plist.plist = create_device_attached_plist(dev);
+	broadcast_device_event(&ev, device_index_add(dev), LISTEN_ATTACHED);
 	pthread_mutex_unlock(&client_list_mutex);
 }
 
@@ -1067,10 +2232,12 @@ void client_device_remove(int device_id)
 	pthread_mutex_lock(&client_list_mutex);
 	uint32_t id = device_id;
 	usbmuxd_log(LL_DEBUG, "client_device_remove: id %d", device_id);
-	FOREACH(struct mux_client *client, &client_list) {
-		if(client->state == CLIENT_LISTEN)
-			send_device_remove(client, id);
-	} ENDFOREACH
+	struct device_listeners *dl = device_index_find(device_id);
+	if (dl) {
+		broadcast_device_message(dl, LISTEN_DETACHED, MESSAGE_DEVICE_REMOVE, "Detached", id);
+		collection_remove(&device_index, dl);
+		device_index_free(dl);
+	}
 	pthread_mutex_unlock(&client_list_mutex);
 }
 
@@ -1079,10 +2246,9 @@ void client_device_paired(int device_id)
 	pthread_mutex_lock(&client_list_mutex);
 	uint32_t id = device_id;
 	usbmuxd_log(LL_DEBUG, "client_device_paired: id %d", device_id);
-	FOREACH(struct mux_client *client, &client_list) {
-		if (client->state == CLIENT_LISTEN)
-			send_device_paired(client, id);
-	} ENDFOREACH
+	struct device_listeners *dl = device_index_find(device_id);
+	if (dl)
+		broadcast_device_message(dl, LISTEN_PAIRED, MESSAGE_DEVICE_PAIRED, "Paired", id);
 	pthread_mutex_unlock(&client_list_mutex);
 }
 
@@ -1090,15 +2256,56 @@ void client_init(void)
 {
 	usbmuxd_log(LL_DEBUG, "client_init");
 	collection_init(&client_list);
+	collection_init(&any_listeners);
+	collection_init(&serial_index);
+	collection_init(&device_index);
+	event_seq = journal_start = (uint64_t)time(NULL) << 20;
+	collection_init(&pending_events);
 	pthread_mutex_init(&client_list_mutex, NULL);
+	if (event_batch_ms > 0) {
+		int res;
+		if (pipe(batch_wakeup) < 0
+				|| fcntl(batch_wakeup[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(batch_wakeup[1], F_SETFL, O_NONBLOCK) < 0
+				|| fcntl(batch_wakeup[0], F_SETFD, FD_CLOEXEC) < 0 || fcntl(batch_wakeup[1], F_SETFD, FD_CLOEXEC) < 0) {
+			usbmuxd_log(LL_ERROR, "Could not set up the event batch wakeup pipe: %s, delivering events right away", strerror(errno));
+			batch_wakeup_close();
+			event_batch_ms = 0;
+		} else if ((res = pthread_create(&batch_thread, NULL, event_batch_thread, NULL)) != 0) {
+			usbmuxd_log(LL_ERROR, "Could not start the event batch thread: %s, delivering events right away", strerror(res));
+			batch_wakeup_close();
+			event_batch_ms = 0;
+		}
+	}
 }
 
 void client_shutdown(void)
 {
 	usbmuxd_log(LL_DEBUG, "client_shutdown");
+	if (event_batch_ms > 0) {
+		pthread_mutex_lock(&client_list_mutex);
+		batch_quit = 1;
+		pthread_cond_signal(&batch_cond);
+		pthread_mutex_unlock(&client_list_mutex);
+		pthread_join(batch_thread, NULL);
+		FOREACH(struct pending_event *pe, &pending_events) {
+			pending_event_free(pe);
+		} ENDFOREACH
+		batch_wakeup_close();
+	}
+	collection_free(&pending_events);
 	FOREACH(struct mux_client *client, &client_list) {
 		client_close(client);
 	} ENDFOREACH
+	FOREACH(struct device_listeners *dl, &device_index) {
+		device_index_free(dl);
+	} ENDFOREACH
+	collection_free(&device_index);
+	journal_free();
+	collection_free(&serial_index);
+	collection_free(&any_listeners);
 	pthread_mutex_destroy(&client_list_mutex);
 	collection_free(&client_list);
+	pthread_mutex_lock(&list_cache_mutex);
+	list_cache_clear();
+	pthread_mutex_unlock(&list_cache_mutex);
 }
@@ -41,6 +41,7 @@ int client_accept(int fd);
 void client_get_fds(struct fdlist *list);
 void client_process(int fd, short events);
 
+void client_set_event_batch(int msec);
 void client_init(void);
 void client_shutdown(void);
 
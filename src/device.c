@@ -29,6 +29,7 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
@@ -48,11 +49,17 @@ int next_device_id;
 
 #define DEV_MRU 65536
 
+// the protocol and length fields are common to both mux header versions
+#define MUX_LENGTH_HEADER_SIZE 8
+
 #define CONN_INBUF_SIZE		262144
 #define CONN_OUTBUF_SIZE	65536
 
 #define ACK_TIMEOUT 30
 
+// how long a closed connection may go without handing data to its client
+#define LINGER_TIMEOUT 1000
+
 enum mux_protocol {
 	MUX_PROTO_VERSION = 0,
 	MUX_PROTO_CONTROL = 1,
@@ -63,7 +70,8 @@ enum mux_protocol {
 enum mux_dev_state {
 	MUXDEV_INIT,	// sent version packet
 	MUXDEV_ACTIVE,	// received version packet, active
-	MUXDEV_DEAD		// dead
+	MUXDEV_DEAD,		// dead
+	MUXDEV_DETACHED	// USB device gone, held for the detach grace period
 };
 
 enum mux_conn_state {
@@ -71,7 +79,8 @@ enum mux_conn_state {
 	CONN_CONNECTED,		// SYN/SYNACK/ACK -> active
 	CONN_REFUSED,		// RST received during SYN
 	CONN_DYING,			// RST received
-	CONN_DEAD			// being freed; used to prevent infinite recursion between client<->device freeing
+	CONN_DEAD,			// being freed; used to prevent infinite recursion between client<->device freeing
+	CONN_LINGERING		// closed and off its device, handing the rest of ib_buf to the client
 };
 
 struct mux_header
@@ -93,6 +102,15 @@ struct version_header
 struct mux_device;
 
 #define CONN_ACK_PENDING 1
+#define CONN_RX_PENDING 2	// got device data in the current RX batch
+#define CONN_TX_HELD 4		// ob_buf holds a segment waiting for the TX scheduler
+
+// highest TX weight; a connection of that weight may send a full-size
+// segment every scheduler round
+#define MAX_TX_WEIGHT 64
+// bytes a connection of weight 1 may send per scheduler round
+#define TX_QUANTUM ((USB_MTU + MAX_TX_WEIGHT - 1) / MAX_TX_WEIGHT)
+#define MAX_TX_WEIGHTS 16
 
 struct mux_connection
 {
@@ -109,9 +127,14 @@ struct mux_connection
 	uint32_t ib_size;
 	uint32_t ib_capacity;
 	unsigned char *ob_buf;
+	uint32_t ob_size;
 	uint32_t ob_capacity;
+	uint32_t tx_deficit;
+	int tx_weight;
+	struct mux_connection *next_held;	// in the device's TX round robin
 	short events;
 	uint64_t last_ack_time;
+	uint64_t linger_time;	// when a lingering connection last made progress
 };
 
 struct mux_device
@@ -128,11 +151,43 @@ struct mux_device
 	int version;
 	uint16_t rx_seq;
 	uint16_t tx_seq;
+	int rx_pending;
+	int tx_held;	// connections with a segment waiting in ob_buf
+	// held connections in the order the TX scheduler visits them
+	struct mux_connection *held_head, *held_tail;
+	// what clients were told about a device that is held while detached
+	struct device_info detached_info;
+	uint64_t detach_time;
+	int reattached;	// came back during the grace period, clients don't know it left
 };
 
 static struct collection device_list;
 pthread_mutex_t device_list_mutex;
 
+// closed connections still flushing to their clients, main thread only
+static struct collection linger_list;
+
+// handed out by device_snapshot_get() until the device list changes;
+// lock order is device_list_mutex, then snapshot_mutex
+static struct device_snapshot *snapshot = NULL;
+static uint64_t snapshot_generation = 0;
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// how long a departed device is held in case it comes right back, 0 to disable
+static int detach_grace_ms = 0;
+
+// TX scheduler weights for device ports, connections to other ports get 1
+static struct {
+	uint16_t port;
+	int weight;
+} tx_weights[MAX_TX_WEIGHTS];
+static int num_tx_weights = 0;
+
+// startup benchmark: time until all devices found at startup are visible
+static uint64_t startup_time;
+static int startup_devices;
+static int startup_pending;
+
 static struct mux_device* get_mux_device_for_id(int device_id)
 {
 	struct mux_device *dev = NULL;
@@ -300,14 +355,110 @@ static int send_tcp(struct mux_connection *conn, uint8_t flags, const unsigned c
 	return res;
 }
 
+static void connection_linger_finish(struct mux_connection *conn)
+{
+	collection_remove(&linger_list, conn);
+	client_close(conn->client);
+	free(conn->ib_buf);
+	free(conn);
+}
+
+/**
+ * Hand data left over from a closed connection to its client as far as
+ * the socket takes it without blocking. The connection is freed once
+ * everything is written or the client is gone.
+ *
+ * @param conn A lingering connection, see connection_linger().
+ */
+static void connection_linger_process(struct mux_connection *conn)
+{
+	int size = client_write(conn->client, conn->ib_buf, conn->ib_size);
+	if(size < 0) {
+		usbmuxd_log(LL_ERROR, "%s: aborting buffer flush to client after error.", __func__);
+		connection_linger_finish(conn);
+		return;
+	}
+	if(size == 0)
+		return;
+	conn->linger_time = mstime64();
+	if(size == (int)conn->ib_size) {
+		connection_linger_finish(conn);
+		return;
+	}
+	conn->ib_size -= size;
+	memmove(conn->ib_buf, conn->ib_buf + size, conn->ib_size);
+}
+
+/**
+ * Take a closed connection off its device and keep its client around
+ * until the event loop has written what is left in ib_buf, or until
+ * LINGER_TIMEOUT passes without progress.
+ */
+static void connection_linger(struct mux_connection *conn)
+{
+	usbmuxd_log(LL_DEBUG, "%s: lingering to flush %u bytes to client", __func__, conn->ib_size);
+	collection_remove(&conn->dev->connections, conn);
+	conn->dev = NULL;
+	free(conn->ob_buf);
+	conn->ob_buf = NULL;
+	conn->state = CONN_LINGERING;
+	conn->linger_time = mstime64();
+	conn->events = POLLOUT;
+	client_set_events(conn->client, conn->events);
+	collection_add(&linger_list, conn);
+}
+
+static struct mux_connection *get_lingering_connection(struct mux_client *client)
+{
+	FOREACH(struct mux_connection *conn, &linger_list) {
+		if(conn->client == client)
+			return conn;
+	} ENDFOREACH
+	return NULL;
+}
+
+// Queue a connection whose ob_buf holds a segment for the TX scheduler
+static void tx_hold(struct mux_connection *conn)
+{
+	struct mux_device *dev = conn->dev;
+	conn->flags |= CONN_TX_HELD;
+	conn->next_held = NULL;
+	if(dev->held_tail)
+		dev->held_tail->next_held = conn;
+	else
+		dev->held_head = conn;
+	dev->held_tail = conn;
+	dev->tx_held++;
+}
+
+static void tx_unhold(struct mux_connection *conn)
+{
+	struct mux_device *dev = conn->dev;
+	struct mux_connection **link = &dev->held_head;
+	struct mux_connection *prev = NULL;
+	while(*link && *link != conn) {
+		prev = *link;
+		link = &prev->next_held;
+	}
+	if(*link) {
+		*link = conn->next_held;
+		if(dev->held_tail == conn)
+			dev->held_tail = prev;
+	}
+	conn->next_held = NULL;
+	conn->flags &= ~CONN_TX_HELD;
+	dev->tx_held--;
+}
+
 static void connection_teardown(struct mux_connection *conn)
 {
 	int res;
-	int size;
 	if(conn->state == CONN_DEAD)
 		return;
 	usbmuxd_log(LL_DEBUG, "connection_teardown dev %d sport %d dport %d", conn->dev->id, conn->sport, conn->dport);
-	if(conn->dev->state != MUXDEV_DEAD && conn->state != CONN_DYING && conn->state != CONN_REFUSED) {
+	if(conn->flags & CONN_TX_HELD)
+		tx_unhold(conn);
+	if(conn->dev->state != MUXDEV_DEAD && conn->dev->state != MUXDEV_DETACHED && conn->state != CONN_DYING && conn->state != CONN_REFUSED) {
 		res = send_tcp(conn, TH_RST, NULL, 0);
 		if(res < 0)
 			usbmuxd_log(LL_ERROR, "Error sending TCP RST to device %d (%d->%d)", conn->dev->id, conn->sport, conn->dport);
@@ -317,32 +468,10 @@ static void connection_teardown(struct mux_connection *conn)
 			client_notify_connect(conn->client, RESULT_CONNREFUSED);
 		} else {
 			conn->state = CONN_DEAD;
-			if((conn->events & POLLOUT) && conn->ib_size > 0){
-				usbmuxd_log(LL_DEBUG, "%s: flushing buffer to client (%u bytes)", __func__, conn->ib_size);
-				uint64_t tm_last = mstime64();
-				while(1){
-					size = client_write(conn->client, conn->ib_buf, conn->ib_size);
-					if(size < 0) {
-						usbmuxd_log(LL_ERROR, "%s: aborting buffer flush to client after error.", __func__);
-						break;
-					} else if (size == 0) {
-						uint64_t tm_now = mstime64();
-						if (tm_now - tm_last > 1000) {
-							usbmuxd_log(LL_ERROR, "%s: aborting buffer flush to client after unsuccessfully attempting for %dms.", __func__, (int)(tm_now - tm_last));
-							break;
-						}
-						usleep(10000);
-						continue;
-					}
-					if(size == (int)conn->ib_size) {
-						conn->ib_size = 0;
-						break;
-					} else {
-						conn->ib_size -= size;
-						memmove(conn->ib_buf, conn->ib_buf + size, conn->ib_size);
-					}
-					tm_last = mstime64();
-				}
+			if((conn->events & POLLOUT) && conn->ib_size > 0) {
+				// don't hold up the other devices and clients for this one
+				connection_linger(conn);
+				return;
 			}
 			client_close(conn->client);
 		}
@@ -360,6 +489,10 @@ int device_start_connect(int device_id, uint16_t dport, struct mux_client *clien
 		usbmuxd_log(LL_WARNING, "Attempted to connect to nonexistent device %d", device_id);
 		return -RESULT_BADDEV;
 	}
+	if(dev->state == MUXDEV_DETACHED) {
+		usbmuxd_log(LL_WARNING, "Attempted to connect to detached device %d", device_id);
+		return -RESULT_BADDEV;
+	}
 
 	uint16_t sport = find_sport(dev);
 	if(!sport) {
@@ -383,6 +516,12 @@ int device_start_connect(int device_id, uint16_t dport, struct mux_client *clien
 	conn->rx_recvd = 0;
 	conn->flags = 0;
 	conn->max_payload = USB_MTU - sizeof(struct mux_header) - sizeof(struct tcphdr);
+	conn->tx_weight = 1;
+	int i;
+	for(i = 0; i < num_tx_weights; i++) {
+		if(tx_weights[i].port == dport)
+			conn->tx_weight = tx_weights[i].weight;
+	}
 
 	conn->ob_buf = malloc(CONN_OUTBUF_SIZE);
 	conn->ob_capacity = CONN_OUTBUF_SIZE;
@@ -425,7 +564,9 @@ static void update_connection(struct mux_connection *conn)
 	if(conn->sendable > conn->max_payload)
 		conn->sendable = conn->max_payload;
 
-	if(conn->sendable > 0)
+	// while the device's TX queue drains or a segment is still held back,
+	// leave client data in the socket
+	if(conn->sendable > 0 && !(conn->flags & CONN_TX_HELD) && !usb_device_tx_congested(conn->dev->usbdev))
 		conn->events |= POLLIN;
 	else
 		conn->events &= ~POLLIN;
@@ -472,6 +613,11 @@ void device_client_process(int device_id, struct mux_client *client, short event
 	struct mux_connection *conn = get_mux_connection(device_id, client);
 	pthread_mutex_unlock(&device_list_mutex);
 	if(!conn) {
+		conn = get_lingering_connection(client);
+		if(conn) {
+			connection_linger_process(conn);
+			return;
+		}
 		usbmuxd_log(LL_WARNING, "Could not find connection for device %d client %p", device_id, client);
 		return;
 	}
@@ -496,7 +642,7 @@ void device_client_process(int device_id, struct mux_client *client, short event
 			memmove(conn->ib_buf, conn->ib_buf + size, conn->ib_size);
 		}
 	}
-	if((events & POLLIN) && conn->sendable > 0) {
+	if((events & POLLIN) && conn->sendable > 0 && !(conn->flags & CONN_TX_HELD) && !usb_device_tx_congested(conn->dev->usbdev)) {
 		// There is inbound trafic on the client socket,
 		// convert it to tcp and send to the device
 		// (if the device's input buffer is not full)
@@ -508,12 +654,18 @@ void device_client_process(int device_id, struct mux_client *client, short event
 			connection_teardown(conn);
 			return;
 		}
-		res = send_tcp(conn, TH_ACK, conn->ob_buf, size);
-		if(res < 0) {
-			connection_teardown(conn);
-			return;
+		if(conn->dev->tx_held > 0 || !usb_device_tx_room(conn->dev->usbdev, USB_MTU)) {
+			// the USB pipe is busy, let the scheduler decide who goes next
+			conn->ob_size = size;
+			tx_hold(conn);
+		} else {
+			res = send_tcp(conn, TH_ACK, conn->ob_buf, size);
+			if(res < 0) {
+				connection_teardown(conn);
+				return;
+			}
+			conn->tx_seq += size;
 		}
-		conn->tx_seq += size;
 	}
 
 	update_connection(conn);
@@ -521,12 +673,12 @@ void device_client_process(int device_id, struct mux_client *client, short event
 
 /**
  * Copy a payload to a connection's in-buffer and
- * set the POLLOUT event mask on the connection so
- * the next main_loop iteration will dispatch the
- * buffer if the connection socket is writable.
+ * mark the connection as part of the current RX batch.
  *
- * Connection buffers are flushed in the
- * device_client_process() function.
+ * The ACK to the device and the client flush are deferred
+ * until all pending USB completions have been processed,
+ * see device_rx_flush(). Connection buffers are otherwise
+ * flushed in the device_client_process() function.
  *
  * @param conn The connection to add incoming data to.
  * @param payload Payload to prepare for writing.
@@ -546,7 +698,111 @@ static void connection_device_input(struct mux_connection *conn, unsigned char *
 	memcpy(conn->ib_buf + conn->ib_size, payload, payload_length);
 	conn->ib_size += payload_length;
 	conn->rx_recvd += payload_length;
-	update_connection(conn);
+	conn->flags |= CONN_RX_PENDING;
+	conn->dev->rx_pending = 1;
+}
+
+/**
+ * Finish an RX batch for a connection: write whatever the client
+ * socket accepts without blocking, then send a single ACK to the
+ * device and update the connection's event mask.
+ *
+ * @param conn The connection that received data in this batch.
+ */
+static void connection_rx_flush(struct mux_connection *conn)
+{
+	conn->flags &= ~CONN_RX_PENDING;
+	if(conn->state != CONN_CONNECTED || !conn->client)
+		return;
+
+	if(conn->ib_size > 0) {
+		int size = client_write(conn->client, conn->ib_buf, conn->ib_size);
+		if(size < 0) {
+			usbmuxd_log(LL_DEBUG, "error writing to client (%d)", size);
+			connection_teardown(conn);
+			return;
+		}
+		conn->tx_ack += size;
+		if(size == (int)conn->ib_size) {
+			conn->ib_size = 0;
+		} else if(size > 0) {
+			conn->ib_size -= size;
+			memmove(conn->ib_buf, conn->ib_buf + size, conn->ib_size);
+		}
+	}
+
+	// Device likes it best when we are prompty ACKing data
+	send_tcp_ack(conn);
+}
+
+/**
+ * Called by the USB layer when the TX queue of a device starts or stops
+ * throttling, to update which clients are polled for input.
+ */
+void device_tx_pressure_changed(struct usb_device *usbdev)
+{
+	// no locking: runs on the main thread, possibly with the mutex held
+	FOREACH(struct mux_device *dev, &device_list) {
+		if(dev->usbdev == usbdev && dev->state == MUXDEV_ACTIVE) {
+			FOREACH(struct mux_connection *conn, &dev->connections) {
+				if(conn->state == CONN_CONNECTED && conn->client)
+					update_connection(conn);
+			} ENDFOREACH
+			break;
+		}
+	} ENDFOREACH
+}
+
+/**
+ * Send held client data in deficit round robin order for as long as the
+ * USB layer takes packets without queueing them. Each visit credits a
+ * connection with TX_QUANTUM bytes times its port weight, and a held
+ * segment goes out once the credit covers it. A connection pushing
+ * full-size segments thus needs several rounds per segment, while a
+ * short request on another connection gets through in the next one.
+ *
+ * While any segment is held there is no room on the USB side, so this
+ * only needs to run again when a transfer completes, see
+ * device_tx_ready().
+ */
+static void device_tx_schedule(struct mux_device *dev)
+{
+	while(dev->held_head && usb_device_tx_room(dev->usbdev, USB_MTU)) {
+		struct mux_connection *conn = dev->held_head;
+		tx_unhold(conn);
+		conn->tx_deficit += TX_QUANTUM * conn->tx_weight;
+		if(conn->tx_deficit < conn->ob_size) {
+			// back to the end of the round
+			tx_hold(conn);
+			continue;
+		}
+		// one segment per connection, so the connection goes idle and
+		// keeps no credit
+		conn->tx_deficit = 0;
+		if(send_tcp(conn, TH_ACK, conn->ob_buf, conn->ob_size) < 0) {
+			connection_teardown(conn);
+			continue;
+		}
+		conn->tx_seq += conn->ob_size;
+		conn->ob_size = 0;
+		update_connection(conn);
+	}
+}
+
+/**
+ * Called by the USB layer when its TX queue is empty after a transfer
+ * completed, to pass on client data held by the scheduler.
+ */
+void device_tx_ready(struct usb_device *usbdev)
+{
+	// no locking: runs on the main thread, possibly with the mutex held
+	FOREACH(struct mux_device *dev, &device_list) {
+		if(dev->usbdev == usbdev) {
+			if(dev->state == MUXDEV_ACTIVE && dev->tx_held > 0)
+				device_tx_schedule(dev);
+			break;
+		}
+	} ENDFOREACH
 }
 
 void device_abort_connect(int device_id, struct mux_client *client)
@@ -562,12 +818,43 @@ void device_abort_connect(int device_id, struct mux_client *client)
 
 static void populate_info(struct usb_device *usbdev, struct device_info *info)
 {
+	if(!usbdev) {
+		return;
+	}
 	info->location = usb_device_get_location(usbdev);
 	info->serial = usb_device_get_serial(usbdev);
 	info->pid = usb_device_get_pid(usbdev);
 	info->speed = usb_device_get_speed(usbdev);
 }
 
+// snapshot_mutex must be held
+static void snapshot_release(struct device_snapshot *snap)
+{
+	int i;
+	if(--snap->refcount > 0)
+		return;
+	for(i = 0; i < snap->count; i++)
+		free((char *)snap->devices[i].serial);
+	free(snap->devices);
+	free(snap);
+}
+
+/**
+ * Drop the current device snapshot, to be rebuilt on the next request.
+ * Call this whenever a device is listed or unlisted, becomes visible, or
+ * its info changes.
+ */
+static void device_list_changed(void)
+{
+	pthread_mutex_lock(&snapshot_mutex);
+	snapshot_generation++;
+	if(snapshot) {
+		snapshot_release(snapshot);
+		snapshot = NULL;
+	}
+	pthread_mutex_unlock(&snapshot_mutex);
+}
+
 static void device_version_input(struct mux_device *dev, struct version_header *vh)
 {
 	if(dev->state != MUXDEV_INIT) {
@@ -578,10 +865,19 @@ static void device_version_input(struct mux_device *dev, struct version_header *
 	vh->minor = ntohl(vh->minor);
 	if(vh->major != 2 && vh->major != 1) {
 		usbmuxd_log(LL_ERROR, "Device %d has unknown version %d.%d", dev->id, vh->major, vh->minor);
-		pthread_mutex_lock(&device_list_mutex);
-		collection_remove(&device_list, dev);
-		pthread_mutex_unlock(&device_list_mutex);
-		free(dev);
+		// keep the entry around so that device_remove() can clean it up,
+		// but stop dispatching any further input for it; the USB side is
+		// torn down by reap_dead_devices() once it sees the device dead
+		dev->state = MUXDEV_DEAD;
+		dev->usbdev->alive = 0;
+		if (dev->reattached) {
+			// clients still hold it from before the glitch; let them go now
+			usbmuxd_log(LL_NOTICE, "Device %d failed to come back, releasing it", dev->id);
+			dev->reattached = 0;
+			client_device_remove(dev->id);
+			dev->visible = 0;
+		}
+		device_list_changed();
 		return;
 	}
 	dev->version = vh->major;
@@ -592,11 +888,21 @@ static void device_version_input(struct mux_device *dev, struct version_header *
 
 	usbmuxd_log(LL_NOTICE, "Connected to v%d.%d device %d on location 0x%x with serial number %s", dev->version, vh->minor, dev->id, usb_device_get_location(dev->usbdev), usb_device_get_serial(dev->usbdev));
 	dev->state = MUXDEV_ACTIVE;
-	collection_init(&dev->connections);
+	device_list_changed();
+	if (dev->reattached) {
+		// clients never saw it go, and it was preflighted moments ago
+		usbmuxd_log(LL_NOTICE, "Device %d is back within the detach grace period", dev->id);
+		dev->reattached = 0;
+		return;
+	}
 	struct device_info info;
 	info.id = dev->id;
 	populate_info(dev->usbdev, &info);
-	preflight_worker_device_add(&info);
+	if (dev->usbdev->transport->preflight) {
+		preflight_worker_device_add(&info);
+	} else {
+		client_device_add(&info);
+	}
 }
 
 static void device_control_input(struct mux_device *dev, unsigned char *payload, uint32_t payload_length)
@@ -717,81 +1023,25 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 			connection_teardown(conn);
 		} else {
 			connection_device_input(conn, payload, payload_length);
-
-			// Device likes it best when we are prompty ACKing data
-			send_tcp_ack(conn);
 		}
 	}
 }
 
 /**
- * Take input data from the device that has been read into a buffer
- * and dispatch it to the right protocol backend (eg. TCP).
+ * Dispatch a single, complete mux packet to the right protocol backend
+ * (eg. TCP).
  *
- * @param usbdev
- * @param buffer
- * @param length
+ * @param dev The device the packet was received from.
+ * @param packet Pointer to the start of the mux header.
+ * @param length Total length of the packet including the mux header.
  */
-void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_t length)
+static void device_packet_input(struct mux_device *dev, unsigned char *packet, uint32_t length)
 {
-	struct mux_device *dev = NULL;
-	pthread_mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *tdev, &device_list) {
-		if(tdev->usbdev == usbdev) {
-			dev = tdev;
-			break;
-		}
-	} ENDFOREACH
-	pthread_mutex_unlock(&device_list_mutex);
-	if(!dev) {
-		usbmuxd_log(LL_WARNING, "Cannot find device entry for RX input from USB device %p on location 0x%x", usbdev, usb_device_get_location(usbdev));
-		return;
-	}
-
-	if(!length)
-		return;
-
-	// sanity check (should never happen with current USB implementation)
-	if((length > USB_MRU) || (length > DEV_MRU)) {
-		usbmuxd_log(LL_ERROR, "Too much data received from USB (%d), file a bug", length);
-		return;
-	}
-
-	usbmuxd_log(LL_SPEW, "Mux data input for device %p: %p len %d", dev, buffer, length);
-
-	// handle broken up transfers
-	if(dev->pktlen) {
-		if((length + dev->pktlen) > DEV_MRU) {
-			usbmuxd_log(LL_ERROR, "Incoming split packet is too large (%d so far), dropping!", length + dev->pktlen);
-			dev->pktlen = 0;
-			return;
-		}
-		memcpy(dev->pktbuf + dev->pktlen, buffer, length);
-		struct mux_header *mhdr = (struct mux_header *)dev->pktbuf;
-		if((length < USB_MRU) || (ntohl(mhdr->length) == (length + dev->pktlen))) {
-			buffer = dev->pktbuf;
-			length += dev->pktlen;
-			dev->pktlen = 0;
-			usbmuxd_log(LL_SPEW, "Gathered mux data from buffer (total size: %d)", length);
-		} else {
-			dev->pktlen += length;
-			usbmuxd_log(LL_SPEW, "Appended mux data to buffer (total size: %d)", dev->pktlen);
-			return;
-		}
-	} else {
-		struct mux_header *mhdr = (struct mux_header *)buffer;
-		if((length == USB_MRU) && (length < ntohl(mhdr->length))) {
-			memcpy(dev->pktbuf, buffer, length);
-			dev->pktlen = length;
-			usbmuxd_log(LL_SPEW, "Copied mux data to buffer (size: %d)", dev->pktlen);
-			return;
-		}
-	}
-
-	struct mux_header *mhdr = (struct mux_header *)buffer;
+	struct mux_header *mhdr = (struct mux_header *)packet;
 	int mux_header_size = ((dev->version < 2) ? 8 : sizeof(struct mux_header));
-	if(ntohl(mhdr->length) != length) {
-		usbmuxd_log(LL_ERROR, "Incoming packet size mismatch (dev %d, expected %d, got %d)", dev->id, ntohl(mhdr->length), length);
+
+	if(length < (uint32_t)mux_header_size) {
+		usbmuxd_log(LL_ERROR, "Incoming packet is too small for its header (dev %d, len %d)", dev->id, length);
 		return;
 	}
 
@@ -830,16 +1080,235 @@ void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_
 			usbmuxd_log(LL_ERROR, "Incoming packet for device %d has unknown protocol 0x%x)", dev->id, ntohl(mhdr->protocol));
 			break;
 	}
+}
 
+/**
+ * Read the total packet length from a (possibly unaligned) mux header.
+ * Only the protocol and length fields are needed, which are at the same
+ * place for the short (v1) and the long (v2) header.
+ */
+static uint32_t mux_packet_length(const unsigned char *packet)
+{
+	uint32_t length;
+	memcpy(&length, packet + offsetof(struct mux_header, length), sizeof(length));
+	return ntohl(length);
+}
+
+static int mux_packet_length_valid(struct mux_device *dev, uint32_t length)
+{
+	if((length < MUX_LENGTH_HEADER_SIZE) || (length > DEV_MRU)) {
+		usbmuxd_log(LL_ERROR, "Incoming packet for device %d has invalid length %d, dropping input", dev->id, length);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Dispatch a packet that lives inside an USB transfer buffer. The
+ * protocol handlers access the headers through struct pointers, so
+ * packets that are not suitably aligned are copied to the packet buffer
+ * first.
+ */
+static void device_packet_input_inplace(struct mux_device *dev, unsigned char *packet, uint32_t length)
+{
+	if(((uintptr_t)packet) & (sizeof(uint32_t) - 1)) {
+		memcpy(dev->pktbuf, packet, length);
+		packet = dev->pktbuf;
+	}
+	device_packet_input(dev, packet, length);
+}
+
+/**
+ * Take input data from the device that has been read into a buffer
+ * and dispatch it to the right protocol backend (eg. TCP).
+ *
+ * The buffer is treated as a part of a stream of mux packets: every
+ * complete packet inside of it is dispatched in place, and only a
+ * trailing packet fragment is copied to the device's packet buffer to
+ * be completed by the following transfer(s).
+ *
+ * @param usbdev
+ * @param buffer
+ * @param length
+ */
+void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_t length)
+{
+	struct mux_device *dev = NULL;
+	pthread_mutex_lock(&device_list_mutex);
+	FOREACH(struct mux_device *tdev, &device_list) {
+		if(tdev->usbdev == usbdev) {
+			dev = tdev;
+			break;
+		}
+	} ENDFOREACH
+	pthread_mutex_unlock(&device_list_mutex);
+	if(!dev) {
+		usbmuxd_log(LL_WARNING, "Cannot find device entry for RX input from USB device %p on location 0x%x", usbdev, usb_device_get_location(usbdev));
+		return;
+	}
+
+	if(!length)
+		return;
+
+	usbmuxd_log(LL_SPEW, "Mux data input for device %p: %p len %d", dev, buffer, length);
+
+	// complete a packet that was split across transfers
+	if(dev->pktlen) {
+		uint32_t chunk;
+		if(dev->pktlen < MUX_LENGTH_HEADER_SIZE) {
+			chunk = MUX_LENGTH_HEADER_SIZE - dev->pktlen;
+			if(chunk > length)
+				chunk = length;
+			memcpy(dev->pktbuf + dev->pktlen, buffer, chunk);
+			dev->pktlen += chunk;
+			buffer += chunk;
+			length -= chunk;
+			if(dev->pktlen < MUX_LENGTH_HEADER_SIZE)
+				return;
+			if(!mux_packet_length_valid(dev, mux_packet_length(dev->pktbuf))) {
+				dev->pktlen = 0;
+				return;
+			}
+		}
+		uint32_t pktsize = mux_packet_length(dev->pktbuf);
+		chunk = pktsize - dev->pktlen;
+		if(chunk > length)
+			chunk = length;
+		memcpy(dev->pktbuf + dev->pktlen, buffer, chunk);
+		dev->pktlen += chunk;
+		buffer += chunk;
+		length -= chunk;
+		if(dev->pktlen < pktsize) {
+			usbmuxd_log(LL_SPEW, "Appended mux data to buffer (total size: %d)", dev->pktlen);
+			return;
+		}
+		dev->pktlen = 0;
+		usbmuxd_log(LL_SPEW, "Gathered mux data from buffer (total size: %d)", pktsize);
+		device_packet_input(dev, dev->pktbuf, pktsize);
+		if(dev->state == MUXDEV_DEAD)
+			return;
+	}
+
+	// dispatch all complete packets without copying them
+	while(length >= MUX_LENGTH_HEADER_SIZE) {
+		uint32_t pktsize = mux_packet_length(buffer);
+		if(!mux_packet_length_valid(dev, pktsize))
+			return;
+		if(pktsize > length)
+			break;
+		device_packet_input_inplace(dev, buffer, pktsize);
+		if(dev->state == MUXDEV_DEAD)
+			return;
+		buffer += pktsize;
+		length -= pktsize;
+	}
+
+	// keep the trailing fragment for the next transfer
+	if(length) {
+		memcpy(dev->pktbuf, buffer, length);
+		dev->pktlen = length;
+		usbmuxd_log(LL_SPEW, "Copied mux data to buffer (size: %d)", dev->pktlen);
+	}
+}
+
+/**
+ * Complete the current RX batch: every connection that received data
+ * since the last call gets one client flush and one ACK, no matter how
+ * many packets or USB transfers carried the data.
+ *
+ * Must be called after each pass of USB event handling.
+ */
+void device_rx_flush(void)
+{
+	FOREACH(struct mux_device *dev, &device_list) {
+		if(!dev->rx_pending)
+			continue;
+		dev->rx_pending = 0;
+		if(dev->state != MUXDEV_ACTIVE)
+			continue;
+		FOREACH(struct mux_connection *conn, &dev->connections) {
+			if(conn->flags & CONN_RX_PENDING)
+				connection_rx_flush(conn);
+		} ENDFOREACH
+	} ENDFOREACH
+}
+
+static void device_free(struct mux_device *dev)
+{
+	collection_free(&dev->connections);
+	free((char *)dev->detached_info.serial);
+	free(dev->pktbuf);
+	free(dev);
+}
+
+// Tell clients that a held device is gone for good; device_list_mutex must be held
+static void device_release_detached(struct mux_device *dev)
+{
+	usbmuxd_log(LL_NOTICE, "Detach grace period of device %d is over", dev->id);
+	client_device_remove(dev->id);
+	collection_remove(&device_list, dev);
+	device_list_changed();
+	device_free(dev);
+}
+
+// Find a device held during its grace period that usbdev is a return of
+static struct mux_device *find_detached(struct usb_device *usbdev)
+{
+	struct mux_device *found = NULL;
+	const char *serial = usb_device_get_serial(usbdev);
+	pthread_mutex_lock(&device_list_mutex);
+	FOREACH(struct mux_device *dev, &device_list) {
+		if(dev->state != MUXDEV_DETACHED || !serial || strcmp(dev->detached_info.serial, serial))
+			continue;
+		if(dev->detached_info.location == usb_device_get_location(usbdev)
+				&& dev->detached_info.pid == usb_device_get_pid(usbdev)) {
+			found = dev;
+		} else {
+			// back somewhere else: clients have to learn the new location
+			device_release_detached(dev);
+		}
+		break;
+	} ENDFOREACH
+	pthread_mutex_unlock(&device_list_mutex);
+	return found;
+}
+
+static int send_version(struct mux_device *dev)
+{
+	struct version_header vh;
+	vh.major = htonl(2);
+	vh.minor = htonl(0);
+	vh.padding = 0;
+	return send_packet(dev, MUX_PROTO_VERSION, &vh, NULL, 0);
 }
 
 int device_add(struct usb_device *usbdev)
 {
 	int res;
-	int id = get_next_device_id();
-	struct mux_device *dev;
+	int id;
+	struct mux_device *dev = find_detached(usbdev);
+	if(dev) {
+		usbmuxd_log(LL_NOTICE, "Reconnecting to device %d on location 0x%x", dev->id, usb_device_get_location(usbdev));
+		dev->usbdev = usbdev;
+		dev->state = MUXDEV_INIT;
+		dev->pktlen = 0;
+		dev->version = 0;
+		dev->reattached = 1;
+		device_list_changed();
+		if((res = send_version(dev)) < 0) {
+			usbmuxd_log(LL_ERROR, "Error sending version request packet to device %d", dev->id);
+			pthread_mutex_lock(&device_list_mutex);
+			device_release_detached(dev);
+			pthread_mutex_unlock(&device_list_mutex);
+			return res;
+		}
+		return 0;
+	}
+
+	id = get_next_device_id();
 	usbmuxd_log(LL_NOTICE, "Connecting to new device on location 0x%x as ID %d", usb_device_get_location(usbdev), id);
 	dev = malloc(sizeof(struct mux_device));
+	memset(dev, 0, sizeof(struct mux_device));
 	dev->id = id;
 	dev->usbdev = usbdev;
 	dev->state = MUXDEV_INIT;
@@ -849,14 +1318,11 @@ int device_add(struct usb_device *usbdev)
 	dev->pktlen = 0;
 	dev->preflight_cb_data = NULL;
 	dev->version = 0;
-	struct version_header vh;
-	vh.major = htonl(2);
-	vh.minor = htonl(0);
-	vh.padding = 0;
-	if((res = send_packet(dev, MUX_PROTO_VERSION, &vh, NULL, 0)) < 0) {
+	dev->rx_pending = 0;
+	collection_init(&dev->connections);
+	if((res = send_version(dev)) < 0) {
 		usbmuxd_log(LL_ERROR, "Error sending version request packet to device %d", id);
-		free(dev->pktbuf);
-		free(dev);
+		device_free(dev);
 		return res;
 	}
 	pthread_mutex_lock(&device_list_mutex);
@@ -870,22 +1336,42 @@ void device_remove(struct usb_device *usbdev)
 	pthread_mutex_lock(&device_list_mutex);
 	FOREACH(struct mux_device *dev, &device_list) {
 		if(dev->usbdev == usbdev) {
+			const char *serial = usb_device_get_serial(usbdev);
+			if(dev->state == MUXDEV_ACTIVE && dev->visible && !dev->preflight_cb_data && serial && detach_grace_ms > 0) {
+				// hold on to it in case this was just a glitch, see device_add()
+				usbmuxd_log(LL_NOTICE, "Detached device %d on location 0x%x, holding it for %d ms", dev->id, usb_device_get_location(usbdev), detach_grace_ms);
+				dev->state = MUXDEV_DETACHED;
+				FOREACH(struct mux_connection *conn, &dev->connections) {
+					connection_teardown(conn);
+				} ENDFOREACH
+				free((char *)dev->detached_info.serial);
+				populate_info(usbdev, &dev->detached_info);
+				dev->detached_info.id = dev->id;
+				dev->detached_info.serial = strdup(serial);
+				dev->detach_time = mstime64();
+				dev->usbdev = NULL;
+				device_list_changed();
+				pthread_mutex_unlock(&device_list_mutex);
+				return;
+			}
 			usbmuxd_log(LL_NOTICE, "Removed device %d on location 0x%x", dev->id, usb_device_get_location(usbdev));
 			if(dev->state == MUXDEV_ACTIVE) {
 				dev->state = MUXDEV_DEAD;
 				FOREACH(struct mux_connection *conn, &dev->connections) {
 					connection_teardown(conn);
 				} ENDFOREACH
+			}
+			// an arrival that goes away before clients heard of it stays silent
+			if(dev->visible) {
 				client_device_remove(dev->id);
-				collection_free(&dev->connections);
 			}
 			if (dev->preflight_cb_data) {
 				preflight_device_remove_cb(dev->preflight_cb_data);
 			}
 			collection_remove(&device_list, dev);
+			device_list_changed();
 			pthread_mutex_unlock(&device_list_mutex);
-			free(dev->pktbuf);
-			free(dev);
+			device_free(dev);
 			return;
 		}
 	} ENDFOREACH
@@ -899,13 +1385,31 @@ void device_set_visible(int device_id)
 	pthread_mutex_lock(&device_list_mutex);
 	FOREACH(struct mux_device *dev, &device_list) {
 		if(dev->id == device_id) {
-			dev->visible = 1;
+			if(!dev->visible && startup_pending > 0 && --startup_pending == 0) {
+				usbmuxd_log(LL_NOTICE, "All %d devices found at startup are visible after %" PRIu64 " ms", startup_devices, mstime64() - startup_time);
+			}
+			if(!dev->visible) {
+				dev->visible = 1;
+				device_list_changed();
+			}
 			break;
 		}
 	} ENDFOREACH
 	pthread_mutex_unlock(&device_list_mutex);
 }
 
+/**
+ * Start measuring the time it takes until the given number of devices,
+ * found while initializing USB, have become visible to clients.
+ */
+void device_measure_startup(int num_devices)
+{
+	pthread_mutex_lock(&device_list_mutex);
+	startup_devices = num_devices;
+	startup_pending = num_devices;
+	pthread_mutex_unlock(&device_list_mutex);
+}
+
 void device_set_preflight_cb_data(int device_id, void* data)
 {
 	pthread_mutex_lock(&device_list_mutex);
@@ -918,6 +1422,34 @@ void device_set_preflight_cb_data(int device_id, void* data)
 	pthread_mutex_unlock(&device_list_mutex);
 }
 
+/**
+ * Copy the transport name and USB transfer statistics of the given device.
+ *
+ * @return 0 on success, -1 if there is no such device
+ */
+int device_get_usb_stats(int device_id, const char **transport, struct usb_xfer_stats *rx, struct usb_xfer_stats *tx)
+{
+	int res = -1;
+	pthread_mutex_lock(&device_list_mutex);
+	FOREACH(struct mux_device *dev, &device_list) {
+		if(dev->id == device_id && dev->usbdev) {
+			*transport = dev->usbdev->transport->name;
+			*rx = dev->usbdev->rx_stats;
+			*tx = dev->usbdev->tx_stats;
+			res = 0;
+			break;
+		}
+	} ENDFOREACH
+	pthread_mutex_unlock(&device_list_mutex);
+	return res;
+}
+
+// whether clients consider the device attached
+static int device_is_listed(struct mux_device *dev)
+{
+	return dev->state == MUXDEV_ACTIVE || dev->state == MUXDEV_DETACHED || dev->reattached;
+}
+
 int device_get_count(int include_hidden)
 {
 	int count = 0;
@@ -927,7 +1459,7 @@ int device_get_count(int include_hidden)
 	pthread_mutex_unlock(&device_list_mutex);
 
 	FOREACH(struct mux_device *dev, &dev_list) {
-		if((dev->state == MUXDEV_ACTIVE) && (include_hidden || dev->visible))
+		if(device_is_listed(dev) && (include_hidden || dev->visible))
 			count++;
 	} ENDFOREACH
 
@@ -935,36 +1467,116 @@ int device_get_count(int include_hidden)
 	return count;
 }
 
-int device_get_list(int include_hidden, struct device_info **devices)
+static void snapshot_add(struct device_snapshot *snap, struct mux_device *dev)
 {
-	int count = 0;
-	struct collection dev_list = {NULL, 0};
+	struct device_info *info = &snap->devices[snap->count++];
+	memset(info, 0, sizeof(struct device_info));
+	if(dev->state == MUXDEV_DETACHED) {
+		*info = dev->detached_info;
+	} else {
+		info->id = dev->id;
+		populate_info(dev->usbdev, info);
+	}
+	info->serial = strdup(info->serial ? info->serial : "");
+}
+
+/**
+ * Get an immutable copy of the device list. It is only rebuilt after the
+ * list has changed, so polling it is cheap, and its generation tells
+ * callers whether anything they derived from an earlier one is stale.
+ * The first snap->visible entries are the devices visible to clients,
+ * in list order, followed by the hidden ones.
+ *
+ * @return a reference to be dropped with device_snapshot_put()
+ */
+struct device_snapshot *device_snapshot_get(void)
+{
+	struct device_snapshot *snap;
 	pthread_mutex_lock(&device_list_mutex);
-	collection_copy(&dev_list, &device_list);
+	pthread_mutex_lock(&snapshot_mutex);
+	if(!snapshot) {
+		snap = malloc(sizeof(struct device_snapshot));
+		memset(snap, 0, sizeof(struct device_snapshot));
+		snap->refcount = 1;
+		snap->generation = snapshot_generation;
+		snap->devices = malloc(sizeof(struct device_info) * (device_list.capacity ? device_list.capacity : 1));
+		FOREACH(struct mux_device *dev, &device_list) {
+			if(device_is_listed(dev) && dev->visible)
+				snapshot_add(snap, dev);
+		} ENDFOREACH
+		snap->visible = snap->count;
+		FOREACH(struct mux_device *dev, &device_list) {
+			if(device_is_listed(dev) && !dev->visible)
+				snapshot_add(snap, dev);
+		} ENDFOREACH
+		snapshot = snap;
+	}
+	snap = snapshot;
+	snap->refcount++;
+	pthread_mutex_unlock(&snapshot_mutex);
 	pthread_mutex_unlock(&device_list_mutex);
+	return snap;
+}
 
-	*devices = malloc(sizeof(struct device_info) * dev_list.capacity);
-	struct device_info *p = *devices;
-
-	FOREACH(struct mux_device *dev, &dev_list) {
-		if((dev->state == MUXDEV_ACTIVE) && (include_hidden || dev->visible)) {
-			p->id = dev->id;
-			populate_info(dev->usbdev, p);
-			count++;
-			p++;
-		}
-	} ENDFOREACH
+void device_snapshot_put(struct device_snapshot *snap)
+{
+	pthread_mutex_lock(&snapshot_mutex);
+	snapshot_release(snap);
+	pthread_mutex_unlock(&snapshot_mutex);
+}
 
-	collection_free(&dev_list);
+/**
+ * Hold devices that go away for this long before telling clients, so
+ * that a device that is back within that time keeps its ID and is not
+ * reported as detached and attached again.
+ */
+void device_set_detach_grace(int msec)
+{
+	detach_grace_ms = msec;
+}
 
-	return count;
+/**
+ * Give connections to a device port a larger share of the USB bandwidth
+ * when several of them have data to send.
+ *
+ * @param spec PORT=WEIGHT, with WEIGHT between 1 and 64
+ * @return 0 on success, a negative value if spec is invalid
+ */
+int device_add_tx_weight(const char *spec)
+{
+	char *end = NULL;
+	long port = strtol(spec, &end, 10);
+	long weight;
+	if(end == spec || *end != '=' || port < 1 || port > 65535) {
+		usbmuxd_log(LL_FATAL, "ERROR: invalid port in TX weight '%s'", spec);
+		return -1;
+	}
+	const char *wstr = end + 1;
+	weight = strtol(wstr, &end, 10);
+	if(end == wstr || *end || weight < 1 || weight > MAX_TX_WEIGHT) {
+		usbmuxd_log(LL_FATAL, "ERROR: TX weight in '%s' must be between 1 and %d", spec, MAX_TX_WEIGHT);
+		return -1;
+	}
+	if(num_tx_weights >= MAX_TX_WEIGHTS) {
+		usbmuxd_log(LL_FATAL, "ERROR: at most %d TX weights can be set", MAX_TX_WEIGHTS);
+		return -1;
+	}
+	tx_weights[num_tx_weights].port = (uint16_t)port;
+	tx_weights[num_tx_weights].weight = (int)weight;
+	num_tx_weights++;
+	return 0;
 }
 
 int device_get_timeout(void)
 {
 	uint64_t oldest = (uint64_t)-1LL;
+	uint64_t detached = (uint64_t)-1LL;
+	uint64_t lingering = (uint64_t)-1LL;
 	pthread_mutex_lock(&device_list_mutex);
 	FOREACH(struct mux_device *dev, &device_list) {
+		if(dev->state == MUXDEV_DETACHED && dev->detach_time < detached) {
+			detached = dev->detach_time;
+		}
 		if(dev->state == MUXDEV_ACTIVE) {
 			FOREACH(struct mux_connection *conn, &dev->connections) {
 				if((conn->state == CONN_CONNECTED) && (conn->flags & CONN_ACK_PENDING) && conn->last_ack_time < oldest)
@@ -973,12 +1585,30 @@ int device_get_timeout(void)
 		}
 	} ENDFOREACH
 	pthread_mutex_unlock(&device_list_mutex);
+	FOREACH(struct mux_connection *conn, &linger_list) {
+		if(conn->linger_time < lingering)
+			lingering = conn->linger_time;
+	} ENDFOREACH
 	uint64_t ct = mstime64();
-	if((int64_t)oldest == -1LL)
-		return 100000; //meh
-	if((ct - oldest) > ACK_TIMEOUT)
-		return 0;
-	return ACK_TIMEOUT - (ct - oldest);
+	int timeout = 100000; //meh
+	if((int64_t)oldest != -1LL) {
+		if((ct - oldest) > ACK_TIMEOUT)
+			return 0;
+		timeout = ACK_TIMEOUT - (ct - oldest);
+	}
+	if((int64_t)detached != -1LL) {
+		if((ct - detached) >= (uint64_t)detach_grace_ms)
+			return 0;
+		if(detach_grace_ms - (int)(ct - detached) < timeout)
+			timeout = detach_grace_ms - (int)(ct - detached);
+	}
+	if((int64_t)lingering != -1LL) {
+		if((ct - lingering) >= LINGER_TIMEOUT)
+			return 0;
+		if(LINGER_TIMEOUT - (int)(ct - lingering) < timeout)
+			timeout = LINGER_TIMEOUT - (int)(ct - lingering);
+	}
+	return timeout;
 }
 
 void device_check_timeouts(void)
@@ -986,6 +1616,10 @@ void device_check_timeouts(void)
 	uint64_t ct = mstime64();
 	pthread_mutex_lock(&device_list_mutex);
 	FOREACH(struct mux_device *dev, &device_list) {
+		if(dev->state == MUXDEV_DETACHED && (ct - dev->detach_time) >= (uint64_t)detach_grace_ms) {
+			device_release_detached(dev);
+			continue;
+		}
 		if(dev->state == MUXDEV_ACTIVE) {
 			FOREACH(struct mux_connection *conn, &dev->connections) {
 				if((conn->state == CONN_CONNECTED) &&
@@ -998,14 +1632,23 @@ void device_check_timeouts(void)
 		}
 	} ENDFOREACH
 	pthread_mutex_unlock(&device_list_mutex);
+	FOREACH(struct mux_connection *conn, &linger_list) {
+		if((ct - conn->linger_time) >= LINGER_TIMEOUT) {
+			usbmuxd_log(LL_ERROR, "Aborting buffer flush to client after unsuccessfully attempting for %dms.", (int)(ct - conn->linger_time));
+			connection_linger_finish(conn);
+		}
+	} ENDFOREACH
 }
 
 void device_init(void)
 {
 	usbmuxd_log(LL_DEBUG, "device_init");
 	collection_init(&device_list);
+	collection_init(&linger_list);
 	pthread_mutex_init(&device_list_mutex, NULL);
 	next_device_id = 1;
+	startup_time = mstime64();
+	startup_pending = 0;
 }
 
 void device_kill_connections(void)
@@ -1030,11 +1673,20 @@ void device_shutdown(void)
 		FOREACH(struct mux_connection *conn, &dev->connections) {
 			connection_teardown(conn);
 		} ENDFOREACH
-		collection_free(&dev->connections);
 		collection_remove(&device_list, dev);
-		free(dev);
+		device_free(dev);
 	} ENDFOREACH
+	device_list_changed();
 	pthread_mutex_unlock(&device_list_mutex);
 	pthread_mutex_destroy(&device_list_mutex);
 	collection_free(&device_list);
+	// one last try for what is still lingering, then drop it
+	FOREACH(struct mux_connection *conn, &linger_list) {
+		connection_linger_process(conn);
+	} ENDFOREACH
+	FOREACH(struct mux_connection *conn, &linger_list) {
+		usbmuxd_log(LL_WARNING, "Dropping %u bytes not flushed to client", conn->ib_size);
+		connection_linger_finish(conn);
+	} ENDFOREACH
+	collection_free(&linger_list);
 }
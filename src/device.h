@@ -32,7 +32,19 @@ struct device_info {
 	uint64_t speed;
 };
 
+// see device_snapshot_get()
+struct device_snapshot {
+	uint64_t generation;
+	int count;	// all listed devices
+	int visible;	// devices[0..visible) are visible to clients
+	struct device_info *devices;
+	int refcount;
+};
+
 void device_data_input(struct usb_device *dev, unsigned char *buf, uint32_t length);
+void device_rx_flush(void);
+void device_tx_pressure_changed(struct usb_device *usbdev);
+void device_tx_ready(struct usb_device *usbdev);
 
 int device_add(struct usb_device *dev);
 void device_remove(struct usb_device *dev);
@@ -42,10 +54,15 @@ void device_client_process(int device_id, struct mux_client *client, short event
 void device_abort_connect(int device_id, struct mux_client *client);
 
 void device_set_visible(int device_id);
+void device_measure_startup(int num_devices);
 void device_set_preflight_cb_data(int device_id, void* data);
+void device_set_detach_grace(int msec);
+int device_add_tx_weight(const char *spec);
 
 int device_get_count(int include_hidden);
-int device_get_list(int include_hidden, struct device_info **devices);
+struct device_snapshot *device_snapshot_get(void);
+void device_snapshot_put(struct device_snapshot *snap);
+int device_get_usb_stats(int device_id, const char **transport, struct usb_xfer_stats *rx, struct usb_xfer_stats *tx);
 
 int device_get_timeout(void);
 void device_check_timeouts(void);
@@ -49,6 +49,9 @@
 
 #include "log.h"
 #include "usb.h"
+#include "usb_bus.h"
+#include "usb_cache.h"
+#include "usb_sim.h"
 #include "device.h"
 #include "client.h"
 #include "conf.h"
@@ -70,6 +73,7 @@ static int drop_privileges = 0;
 static const char *drop_user = NULL;
 static int opt_disable_hotplug = 0;
 static int opt_enable_exit = 0;
+static const char *opt_attach_cache = NULL;
 static int opt_exit = 0;
 static int exit_signal = 0;
 static int daemon_pipe;
@@ -558,6 +562,18 @@ static void usage()
 	printf("  -X, --force-exit\tNotify a running instance to exit even if there are still\n");
 	printf("                  \tdevices connected (always works) and exit.\n");
 	printf("  -l, --logfile=LOGFILE\tLog (append) to LOGFILE instead of stderr or syslog.\n");
+	printf("  -D, --sim-device SPEC\tAdd a simulated device, see usbmuxd(8) for SPEC.\n");
+	printf("  -R, --usbfs\t\tMove device I/O from libusb to raw usbfs after attaching.\n");
+	printf("  -G, --detach-grace MSEC  Hold a detached device for MSEC milliseconds and\n");
+	printf("            \t\tkeep its ID if it comes back in time. Default: 0 (off)\n");
+	printf("  -W, --tx-weight PORT=WEIGHT  Give connections to device PORT WEIGHT times\n");
+	printf("            \t\tthe default share of USB bandwidth. May be repeated.\n");
+	printf("  -b, --bus-share SERIAL=WEIGHT  Give device SERIAL WEIGHT times the default\n");
+	printf("            \t\tshare of a bus it shares with other devices. May be repeated.\n");
+	printf("  -B, --event-batch MSEC  Gather device events for MSEC milliseconds and\n");
+	printf("            \t\tdeliver them to each client together. Default: 0 (off)\n");
+	printf("  -C, --attach-cache FILE  Load the USB attach cache from FILE at startup and\n");
+	printf("            \t\tsave it there on exit to speed up re-attaching devices.\n");
 	printf("  -V, --version\t\tPrint version information and exit.\n");
 	printf("\n");
 	printf("Homepage:    <" PACKAGE_URL ">\n");
@@ -585,17 +601,24 @@ static void parse_opts(int argc, char **argv)
 		{"exit", no_argument, NULL, 'x'},
 		{"force-exit", no_argument, NULL, 'X'},
 		{"logfile", required_argument, NULL, 'l'},
+		{"attach-cache", required_argument, NULL, 'C'},
+		{"sim-device", required_argument, NULL, 'D'},
+		{"usbfs", no_argument, NULL, 'R'},
+		{"detach-grace", required_argument, NULL, 'G'},
+		{"tx-weight", required_argument, NULL, 'W'},
+		{"bus-share", required_argument, NULL, 'b'},
+		{"event-batch", required_argument, NULL, 'B'},
 		{"version", no_argument, NULL, 'V'},
 		{NULL, 0, NULL, 0}
 	};
 	int c;
 
 #ifdef HAVE_SYSTEMD
-	const char* opts_spec = "hfvVuU:xXsnzl:pS:P:";
+	const char* opts_spec = "hfvVuU:xXsnzl:pS:P:C:D:RG:W:b:B:";
 #elif HAVE_UDEV
-	const char* opts_spec = "hfvVuU:xXnzl:pS:P:";
+	const char* opts_spec = "hfvVuU:xXnzl:pS:P:C:D:RG:W:b:B:";
 #else
-	const char* opts_spec = "hfvVU:xXnzl:pS:P:";
+	const char* opts_spec = "hfvVU:xXnzl:pS:P:C:D:RG:W:b:B:";
 #endif
 
 	while (1) {
@@ -686,6 +709,57 @@ static void parse_opts(int argc, char **argv)
 				use_logfile = 1;
 			}
 			break;
+		case 'C':
+			if (!*optarg) {
+				usbmuxd_log(LL_FATAL, "ERROR: --attach-cache requires a non-empty filename");
+				usage();
+				exit(2);
+			}
+			opt_attach_cache = optarg;
+			break;
+		case 'D':
+			if (usb_sim_add_spec(optarg) < 0) {
+				usage();
+				exit(2);
+			}
+			break;
+		case 'R':
+			usb_use_usbfs(1);
+			break;
+		case 'G': {
+			char *end = NULL;
+			long msec = strtol(optarg, &end, 10);
+			if (!*optarg || *end || msec < 0 || msec > 60000) {
+				usbmuxd_log(LL_FATAL, "ERROR: --detach-grace requires a number of milliseconds up to 60000");
+				usage();
+				exit(2);
+			}
+			device_set_detach_grace((int)msec);
+			break;
+		}
+		case 'W':
+			if (device_add_tx_weight(optarg) < 0) {
+				usage();
+				exit(2);
+			}
+			break;
+		case 'b':
+			if (usb_bus_add_weight(optarg) < 0) {
+				usage();
+				exit(2);
+			}
+			break;
+		case 'B': {
+			char *end = NULL;
+			long msec = strtol(optarg, &end, 10);
+			if (!*optarg || *end || msec < 0 || msec > 1000) {
+				usbmuxd_log(LL_FATAL, "ERROR: --event-batch requires a number of milliseconds up to 1000");
+				usage();
+				exit(2);
+			}
+			client_set_event_batch((int)msec);
+			break;
+		}
 		default:
 			usage();
 			exit(2);
@@ -907,10 +981,12 @@ int main(int argc, char *argv[])
 	client_init();
 	device_init();
 	usbmuxd_log(LL_INFO, "Initializing USB");
+	usb_cache_init(opt_attach_cache);
 	if((res = usb_init()) < 0)
 		goto terminate;
 
 	usbmuxd_log(LL_INFO, "%d device%s detected", res, (res==1)?"":"s");
+	device_measure_startup(res);
 
 	usbmuxd_log(LL_NOTICE, "Initialization complete");
 
@@ -931,6 +1007,7 @@ int main(int argc, char *argv[])
 	usbmuxd_log(LL_NOTICE, "usbmuxd shutting down");
 	device_kill_connections();
 	usb_shutdown();
+	usb_cache_shutdown();
 	device_shutdown();
 	client_shutdown();
 	usbmuxd_log(LL_NOTICE, "Shutdown complete");
@@ -0,0 +1,223 @@
+/*
+ * plist_scan.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "plist_scan.h"
+
+/*
+ * Almost every command a client sends is a flat XML dict of a few
+ * strings, integers and booleans. Such commands are read here in a single
+ * pass, without building a plist tree. Anything else, like an unknown
+ * key, a nested value, data, or a string with entities, makes the scan
+ * fail; the caller then parses the payload with libplist as before.
+ */
+
+enum scan_type {
+	SCAN_STRING,
+	SCAN_UINT,
+	SCAN_BOOL
+};
+
+static const struct {
+	const char *name;
+	enum scan_type type;
+	int index;
+} scan_keys[] = {
+	{ "PairRecordID", SCAN_STRING, SCAN_PAIR_RECORD_ID },
+	{ "BundleID", SCAN_STRING, SCAN_BUNDLE_ID },
+	{ "ClientVersionString", SCAN_STRING, SCAN_CLIENT_VERSION_STRING },
+	{ "ProgName", SCAN_STRING, SCAN_PROG_NAME },
+	{ "DeviceID", SCAN_UINT, SCAN_DEVICE_ID },
+	{ "PortNumber", SCAN_UINT, SCAN_PORT_NUMBER },
+	{ "kLibUSBMuxVersion", SCAN_UINT, SCAN_LIB_USBMUX_VERSION },
+	{ "EventSequence", SCAN_UINT, SCAN_EVENT_SEQUENCE },
+	{ "BinaryPlist", SCAN_BOOL, SCAN_BINARY_PLIST },
+	{ "AcceptBatches", SCAN_BOOL, SCAN_ACCEPT_BATCHES },
+};
+
+static const struct {
+	const char *name;
+	enum scan_command command;
+} scan_commands[] = {
+	{ "Listen", SCAN_LISTEN },
+	{ "Connect", SCAN_CONNECT },
+	{ "ListDevices", SCAN_LIST_DEVICES },
+	{ "ListListeners", SCAN_LIST_LISTENERS },
+	{ "ReadBUID", SCAN_READ_BUID },
+	{ "ReadStatistics", SCAN_READ_STATISTICS },
+	{ "ReadPairRecord", SCAN_READ_PAIR_RECORD },
+	{ "DeletePairRecord", SCAN_DELETE_PAIR_RECORD },
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+struct scanner {
+	const char *p;
+	const char *end;
+};
+
+static void skip_ws(struct scanner *s)
+{
+	while (s->p < s->end && (*s->p == ' ' || *s->p == '\t' || *s->p == '\n' || *s->p == '\r'))
+		s->p++;
+}
+
+static int scan_literal(struct scanner *s, const char *lit)
+{
+	size_t len = strlen(lit);
+	skip_ws(s);
+	if ((size_t)(s->end - s->p) < len || memcmp(s->p, lit, len))
+		return 0;
+	s->p += len;
+	return 1;
+}
+
+// skip past the next '>'
+static int skip_tag(struct scanner *s)
+{
+	const char *gt = memchr(s->p, '>', s->end - s->p);
+	if (!gt)
+		return 0;
+	s->p = gt + 1;
+	return 1;
+}
+
+// text up to the next '<', which must not need unescaping
+static int text(struct scanner *s, struct scan_string *str)
+{
+	const char *lt = memchr(s->p, '<', s->end - s->p);
+	if (!lt || memchr(s->p, '&', lt - s->p))
+		return 0;
+	str->ptr = s->p;
+	str->len = lt - s->p;
+	s->p = lt;
+	return 1;
+}
+
+static int string_value(struct scanner *s, struct scan_string *str)
+{
+	if (scan_literal(s, "<string/>")) {
+		str->ptr = s->p;
+		str->len = 0;
+		return 1;
+	}
+	return scan_literal(s, "<string>") && text(s, str) && scan_literal(s, "</string>");
+}
+
+static int uint_value(struct scanner *s, uint64_t *val)
+{
+	const char *start;
+	if (!scan_literal(s, "<integer>"))
+		return 0;
+	skip_ws(s);
+	start = s->p;
+	*val = 0;
+	while (s->p < s->end && *s->p >= '0' && *s->p <= '9') {
+		if (*val > (UINT64_MAX - 9) / 10)
+			return 0;
+		*val = *val * 10 + (*s->p - '0');
+		s->p++;
+	}
+	return s->p != start && scan_literal(s, "</integer>");
+}
+
+static int name_is(struct scan_string *str, const char *name)
+{
+	return strlen(name) == str->len && !memcmp(str->ptr, name, str->len);
+}
+
+/**
+ * Read a command from an XML plist payload.
+ *
+ * @return 0 if the payload is a command this scanner understands and scan
+ *   holds its fields, -1 if it has to be parsed with libplist
+ */
+int plist_scan_xml(const char *xml, uint32_t len, struct plist_scan *scan)
+{
+	struct scanner s = { xml, xml + len };
+	struct scan_string key, message = { NULL, 0 };
+	size_t i;
+
+	memset(scan, 0, sizeof(*scan));
+	for (i = 0; i < SCAN_NUM_BOOLS; i++)
+		scan->bools[i] = -1;
+
+	if (scan_literal(&s, "<?xml") && !skip_tag(&s))
+		return -1;
+	if (scan_literal(&s, "<!DOCTYPE") && !skip_tag(&s))
+		return -1;
+	if (!scan_literal(&s, "<plist") || !skip_tag(&s) || !scan_literal(&s, "<dict>"))
+		return -1;
+
+	while (!scan_literal(&s, "</dict>")) {
+		if (!scan_literal(&s, "<key>") || !text(&s, &key) || !scan_literal(&s, "</key>"))
+			return -1;
+		if (name_is(&key, "MessageType")) {
+			if (!string_value(&s, &message))
+				return -1;
+			continue;
+		}
+		for (i = 0; i < ARRAY_SIZE(scan_keys); i++) {
+			if (name_is(&key, scan_keys[i].name))
+				break;
+		}
+		if (i == ARRAY_SIZE(scan_keys))
+			return -1;
+		switch (scan_keys[i].type) {
+		case SCAN_STRING:
+			if (!string_value(&s, &scan->strings[scan_keys[i].index]))
+				return -1;
+			break;
+		case SCAN_UINT:
+			if (!uint_value(&s, &scan->uints[scan_keys[i].index]))
+				return -1;
+			scan->have_uints |= 1 << scan_keys[i].index;
+			break;
+		case SCAN_BOOL:
+			if (scan_literal(&s, "<true/>"))
+				scan->bools[scan_keys[i].index] = 1;
+			else if (scan_literal(&s, "<false/>"))
+				scan->bools[scan_keys[i].index] = 0;
+			else
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+	}
+	if (!scan_literal(&s, "</plist>"))
+		return -1;
+	// clients may count a terminating NUL into the payload
+	skip_ws(&s);
+	while (s.p < s.end && *s.p == '\0')
+		s.p++;
+	if (s.p != s.end || !message.ptr)
+		return -1;
+
+	for (i = 0; i < ARRAY_SIZE(scan_commands); i++) {
+		if (name_is(&message, scan_commands[i].name)) {
+			scan->command = scan_commands[i].command;
+			return 0;
+		}
+	}
+	return -1;
+}
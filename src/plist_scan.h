@@ -0,0 +1,72 @@
+/*
+ * plist_scan.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef PLIST_SCAN_H
+#define PLIST_SCAN_H
+
+#include <stdint.h>
+
+enum scan_command {
+	SCAN_LISTEN,
+	SCAN_CONNECT,
+	SCAN_LIST_DEVICES,
+	SCAN_LIST_LISTENERS,
+	SCAN_READ_BUID,
+	SCAN_READ_STATISTICS,
+	SCAN_READ_PAIR_RECORD,
+	SCAN_DELETE_PAIR_RECORD
+};
+
+enum scan_string_key {
+	SCAN_PAIR_RECORD_ID,
+	SCAN_BUNDLE_ID,
+	SCAN_CLIENT_VERSION_STRING,
+	SCAN_PROG_NAME,
+	SCAN_NUM_STRINGS
+};
+
+enum scan_uint_key {
+	SCAN_DEVICE_ID,
+	SCAN_PORT_NUMBER,
+	SCAN_LIB_USBMUX_VERSION,
+	SCAN_EVENT_SEQUENCE,
+	SCAN_NUM_UINTS
+};
+
+enum scan_bool_key {
+	SCAN_BINARY_PLIST,
+	SCAN_ACCEPT_BATCHES,
+	SCAN_NUM_BOOLS
+};
+
+// a string value, pointing into the scanned payload
+struct scan_string {
+	const char *ptr;	// NULL if the key is absent
+	uint32_t len;
+};
+
+struct plist_scan {
+	enum scan_command command;
+	struct scan_string strings[SCAN_NUM_STRINGS];
+	uint64_t uints[SCAN_NUM_UINTS];
+	uint32_t have_uints;	// bit per enum scan_uint_key
+	int bools[SCAN_NUM_BOOLS];	// -1 if absent
+};
+
+int plist_scan_xml(const char *xml, uint32_t len, struct plist_scan *scan);
+
+#endif
@@ -36,6 +36,12 @@
 #include "log.h"
 #include "device.h"
 #include "utils.h"
+#include "worker.h"
+#include "usb_bus.h"
+#include "usb_cache.h"
+#include "usb_sim.h"
+#include "usb_usbfs.h"
+#include "usb_udev.h"
 
 #if (defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)) || (defined(LIBUSBX_API_VERSION) && (LIBUSBX_API_VERSION >= 0x01000102))
 #define HAVE_LIBUSB_HOTPLUG_API 1
@@ -55,26 +61,108 @@ static struct collection device_list;
 
 static struct timeval next_dev_poll_time;
 
+// Number of worker threads that configure newly attached devices in parallel.
+#define NUM_CONFIG_WORKERS 4
+
 static int devlist_failures;
 static int device_polling;
 static int device_hotplug = 1;
+#ifdef HAVE_LINUX_USBDEVICE_FS_H
+static int device_usbfs = 0;
+#endif
 
-static void usb_disconnect(struct usb_device *dev)
+static void usb_device_free(struct usb_device *usbdev)
 {
-	int res = usb_device_disconnect(dev);
-	if (res == 0) {
-		collection_remove(&device_list, dev);
-		free(dev);
+	if(usbdev->dev) {
+		libusb_release_interface(usbdev->dev, usbdev->interface);
+		libusb_close(usbdev->dev);
+		usbdev->dev = NULL;
 	}
+	if(usbdev->device) {
+		libusb_unref_device(usbdev->device);
+		usbdev->device = NULL;
+	}
+	usb_bus_remove(usbdev);
+	usb_device_tx_queue_free(usbdev);
+	collection_free(&usbdev->recovery.tx_stalled);
+	collection_free(&usbdev->tx_xfers);
+	collection_free(&usbdev->rx_xfers);
+	collection_remove(&device_list, usbdev);
+	free(usbdev);
+}
+
+// reap the URBs of every device that was handed over to usbfs
+static void usbfs_process(void)
+{
+#ifdef HAVE_LINUX_USBDEVICE_FS_H
+	FOREACH(struct usb_device *usbdev, &device_list) {
+		usb_usbfs_process(usbdev);
+	} ENDFOREACH
+#endif
+}
+
+static void rx_callback(struct libusb_transfer *xfer);
+
+/**
+ * Post more RX transfers for devices whose share of their bus has grown
+ * since a neighbour left. Shrinking happens as transfers complete, see
+ * usb_rx_resubmit_allowed().
+ */
+static void rx_rebalance(void)
+{
+	FOREACH(struct usb_device *usbdev, &device_list) {
+		if(usbdev->state != USBDEV_ACTIVE || !usbdev->alive || !usbdev->bus_group)
+			continue;
+		if(usbdev->recovery.pending & USB_RECOVER_RX)
+			continue;
+		int missing = usb_bus_rx_share(usbdev, NUM_RX_LOOPS) - collection_count(&usbdev->rx_xfers);
+		if(missing <= 0)
+			continue;
+		usbmuxd_log(LL_DEBUG, "Starting %d more RX loops for device %d-%d", missing, usbdev->bus, usbdev->address);
+#ifdef HAVE_LINUX_USBDEVICE_FS_H
+		if(usbdev->usbfs_fd >= 0) {
+			usb_usbfs_start_rx(usbdev, missing);
+			continue;
+		}
+#endif
+		while(missing-- > 0) {
+			if(usb_device_start_rx_loop(usbdev, rx_callback) < 0)
+				break;
+		}
+	} ENDFOREACH
 }
 
 static void reap_dead_devices(void) {
+	int left = 0;
 	FOREACH(struct usb_device *usbdev, &device_list) {
-		if(!usbdev->alive) {
+		// devices that are being configured are cleaned up once the worker is done
+		if(usbdev->state == USBDEV_CONFIGURING)
+			continue;
+		if(!usbdev->alive && usbdev->state != USBDEV_DISCONNECTING) {
+			if(usbdev->bus_group) {
+				usb_bus_remove(usbdev);
+				left = 1;
+			}
 			device_remove(usbdev);
-			usb_disconnect(usbdev);
+			usb_device_disconnect(usbdev);
+		}
+		// free devices whose last transfer callback has fired
+		if(usb_device_disconnect_finished(usbdev)) {
+			usb_device_free(usbdev);
 		}
 	} ENDFOREACH
+	if(left)
+		rx_rebalance();
+}
+
+/**
+ * Whether a completed RX transfer should be resubmitted, or retired
+ * because the device has more posted than its share of the bus.
+ * xfers counts the device's RX transfers besides the completed one.
+ */
+int usb_rx_resubmit_allowed(struct usb_device *dev, int xfers)
+{
+	return xfers < usb_bus_rx_share(dev, NUM_RX_LOOPS);
 }
 
 // Callback from read operation
@@ -82,11 +170,35 @@ static void reap_dead_devices(void) {
 // doing a kind of read-callback loop
 static void rx_callback(struct libusb_transfer *xfer)
 {
-	struct usb_device *dev = xfer->user_data;
+	struct usb_device *dev = usb_device_xfer_get_device(xfer);
+	usb_device_account_xfer(xfer, &dev->rx_stats);
 	usbmuxd_log(LL_SPEW, "RX callback dev %d-%d len %d status %d", dev->bus, dev->address, xfer->actual_length, xfer->status);
+	if(dev->state == USBDEV_DISCONNECTING) {
+		// the mux device is gone already, just let the transfer go
+		collection_remove(&dev->rx_xfers, xfer);
+		usb_device_free_xfer(xfer);
+		return;
+	}
 	if(xfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		int res;
+		dev->recovery.failures = 0;
 		device_data_input(dev, xfer->buffer, xfer->actual_length);
-		libusb_submit_transfer(xfer);
+		if(!usb_rx_resubmit_allowed(dev, collection_count(&dev->rx_xfers) - 1)) {
+			usbmuxd_log(LL_DEBUG, "Retiring an RX transfer of device %d-%d, its bus is shared", dev->bus, dev->address);
+			collection_remove(&dev->rx_xfers, xfer);
+			usb_device_free_xfer(xfer);
+			return;
+		}
+		// this transfer is still in rx_xfers, don't count it as in flight
+		if((res = usb_device_submit_xfer(xfer, &dev->rx_stats, collection_count(&dev->rx_xfers) - 1)) < 0) {
+			usbmuxd_log(LL_ERROR, "Failed to resubmit RX transfer to device %d-%d: %s", dev->bus, dev->address, libusb_error_name(res));
+			collection_remove(&dev->rx_xfers, xfer);
+			usb_device_free_xfer(xfer);
+			dev->alive = 0;
+		}
+	} else if(usb_device_recover_rx(dev, xfer) == 0) {
+		// restarted once the halt has been cleared
+		return;
 	} else {
 		switch(xfer->status) {
 			case LIBUSB_TRANSFER_COMPLETED: //shut up compiler
@@ -116,22 +228,39 @@ static void rx_callback(struct libusb_transfer *xfer)
 				break;
 		}
 
-		free(xfer->buffer);
 		collection_remove(&dev->rx_xfers, xfer);
-		libusb_free_transfer(xfer);
+		usb_device_free_xfer(xfer);
 
-		// we can't usb_disconnect here due to a deadlock, so instead mark it as dead and reap it after processing events
-		// we'll do device_remove there too
+		// mark it as dead and reap it after processing events,
+		// we'll do device_remove and usb_device_disconnect there
 		dev->alive = 0;
 	}
 }
 
+static int usb_device_request_langid(struct usb_device *usbdev, struct libusb_transfer *transfer);
+static int usb_device_request_serial(struct usb_device *usbdev, struct libusb_transfer *transfer, uint16_t langid);
+
 static void get_serial_callback(struct libusb_transfer *transfer)
 {
 	unsigned int di, si;
 	struct usb_device *usbdev = transfer->user_data;
 
+	usbdev->probe_xfer = NULL;
+	if(usbdev->state == USBDEV_DISCONNECTING) {
+		libusb_free_transfer(transfer);
+		return;
+	}
+
 	if(transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		if(usbdev->langid_cached) {
+			// maybe the cached language ID is wrong, ask the device for it
+			usbmuxd_log(LL_NOTICE, "Failed to request serial with cached lang ID for device %d-%d (%i), probing again", usbdev->bus, usbdev->address, transfer->status);
+			usb_cache_invalidate(&usbdev->cache);
+			usbdev->langid_cached = 0;
+			if(usb_device_request_langid(usbdev, transfer) < 0)
+				libusb_free_transfer(transfer);
+			return;
+		}
 		usbmuxd_log(LL_ERROR, "Failed to request serial for device %d-%d (%i)", usbdev->bus, usbdev->address, transfer->status);
 		libusb_free_transfer(transfer);
 		return;
@@ -161,44 +290,63 @@ static void get_serial_callback(struct libusb_transfer *transfer)
 	}
 
 	/* Finish setup now */
+	usbdev->state = USBDEV_ACTIVE;
+#ifdef HAVE_LINUX_USBDEVICE_FS_H
+	if(device_usbfs) {
+		usb_usbfs_attach(usbdev);
+	}
+#endif
 	if(device_add(usbdev) < 0) {
-		usb_disconnect(usbdev);
+		usb_device_disconnect(usbdev);
 		return;
 	}
+	usb_bus_add(usbdev);
 
-	// Spin up NUM_RX_LOOPS parallel usb data retrieval loops
+	// Spin up NUM_RX_LOOPS parallel usb data retrieval loops, fewer
+	// if the bus is shared with other devices
 	// Old usbmuxds used only 1 rx loop, but that leaves the
 	// USB port sleeping most of the time
-	int rx_loops = NUM_RX_LOOPS;
-	for (rx_loops = NUM_RX_LOOPS; rx_loops > 0; rx_loops--) {
+	int num_loops = usb_bus_rx_share(usbdev, NUM_RX_LOOPS);
+	int rx_loops = num_loops;
+#ifdef HAVE_LINUX_USBDEVICE_FS_H
+	if(usbdev->usbfs_fd >= 0) {
+		int res = usb_usbfs_start_rx(usbdev, num_loops);
+		rx_loops = (res < 0) ? num_loops : num_loops - res;
+	} else
+#endif
+	for (rx_loops = num_loops; rx_loops > 0; rx_loops--) {
 		if(usb_device_start_rx_loop(usbdev, rx_callback) < 0) {
-			usbmuxd_log(LL_WARNING, "Failed to start RX loop number %d", NUM_RX_LOOPS - rx_loops);
+			usbmuxd_log(LL_WARNING, "Failed to start RX loop number %d", num_loops - rx_loops);
 			break;
 		}
 	}
 
 	// Ensure we have at least 1 RX loop going
-	if (rx_loops == NUM_RX_LOOPS) {
+	if (rx_loops == num_loops) {
 		usbmuxd_log(LL_FATAL, "Failed to start any RX loop for device %d-%d",
 					usbdev->bus, usbdev->address);
+		usb_bus_remove(usbdev);
 		device_remove(usbdev);
-		usb_disconnect(usbdev);
+		usb_device_disconnect(usbdev);
 		return;
 	} else if (rx_loops > 0) {
 		usbmuxd_log(LL_WARNING, "Failed to start all %d RX loops. Going on with %d loops. "
 					"This may have negative impact on device read speed.",
-					NUM_RX_LOOPS, NUM_RX_LOOPS - rx_loops);
+					num_loops, num_loops - rx_loops);
 	} else {
-		usbmuxd_log(LL_DEBUG, "All %d RX loops started successfully", NUM_RX_LOOPS);
+		usbmuxd_log(LL_DEBUG, "All %d RX loops started successfully", num_loops);
 	}
 }
 
 static void get_langid_callback(struct libusb_transfer *transfer)
 {
-	int res;
 	struct usb_device *usbdev = transfer->user_data;
 
-	transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
+	usbdev->probe_xfer = NULL;
+	if(usbdev->state == USBDEV_DISCONNECTING) {
+		libusb_free_transfer(transfer);
+		return;
+	}
 
 	if(transfer->status != LIBUSB_TRANSFER_COMPLETED) {
 		 usbmuxd_log(LL_ERROR, "Failed to request lang ID for device %d-%d (%i)", usbdev->bus,
@@ -210,8 +358,17 @@ static void get_langid_callback(struct libusb_transfer *transfer)
 	unsigned char *data = libusb_control_transfer_get_data(transfer);
 	uint16_t langid = (uint16_t)(data[2] | (data[3] << 8));
 	usbmuxd_log(LL_INFO, "Got lang ID %u for device %d-%d", langid, usbdev->bus, usbdev->address);
+	usb_cache_set_langid(&usbdev->cache, langid);
 
 	/* re-use the same transfer */
+	if(usb_device_request_serial(usbdev, transfer, langid) < 0)
+		libusb_free_transfer(transfer);
+}
+
+static int usb_device_request_serial(struct usb_device *usbdev, struct libusb_transfer *transfer, uint16_t langid)
+{
+	int res;
+
 	libusb_fill_control_setup(transfer->buffer, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR,
 			(uint16_t)((LIBUSB_DT_STRING << 8) | usbdev->devdesc.iSerialNumber),
 			langid, 1024 + LIBUSB_CONTROL_SETUP_SIZE);
@@ -219,80 +376,44 @@ static void get_langid_callback(struct libusb_transfer *transfer)
 
 	if((res = libusb_submit_transfer(transfer)) < 0) {
 		usbmuxd_log(LL_ERROR, "Could not request transfer for device %d-%d: %s", usbdev->bus, usbdev->address, libusb_error_name(res));
-		libusb_free_transfer(transfer);
+		return res;
 	}
+	usbdev->probe_xfer = transfer;
+	return 0;
 }
 
-static int usb_device_add(libusb_device* dev)
+static int usb_device_request_langid(struct usb_device *usbdev, struct libusb_transfer *transfer)
 {
-	int j, res;
-	// the following are non-blocking operations on the device list
-	uint8_t bus = libusb_get_bus_number(dev);
-	uint8_t address = libusb_get_device_address(dev);
-	struct libusb_device_descriptor devdesc;
-	struct libusb_transfer *transfer;
-	int found = 0;
-	FOREACH(struct usb_device *usbdev, &device_list) {
-		if(usbdev->bus == bus && usbdev->address == address) {
-			usbdev->alive = 1;
-			found = 1;
-			break;
-		}
-	} ENDFOREACH
-	if(found)
-		return 0; //device already found
+	int res;
 
-	if((res = libusb_get_device_descriptor(dev, &devdesc)) != 0) {
-		usbmuxd_log(LL_WARNING, "Could not get device descriptor for device %d-%d: %s", bus, address, libusb_error_name(res));
-		return -1;
-	}
-	if(devdesc.idVendor != VID_APPLE)
-		return -1;
-	if((devdesc.idProduct != PID_APPLE_T2_COPROCESSOR) &&
-		((devdesc.idProduct < PID_RANGE_LOW) ||
-		(devdesc.idProduct > PID_RANGE_MAX)))
-		return -1;
-	libusb_device_handle *handle;
-	usbmuxd_log(LL_INFO, "Found new device with v/p %04x:%04x at %d-%d", devdesc.idVendor, devdesc.idProduct, bus, address);
-	// No blocking operation can follow: it may be run in the libusb hotplug callback and libusb will refuse any
-	// blocking call
-	if((res = libusb_open(dev, &handle)) != 0) {
-		usbmuxd_log(LL_WARNING, "Could not open device %d-%d: %s", bus, address, libusb_error_name(res));
-		return -1;
-	}
+	/**
+	 * From libusb:
+	 * 	Asking for the zero'th index is special - it returns a string
+	 * 	descriptor that contains all the language IDs supported by the
+	 * 	device.
+	 **/
+	libusb_fill_control_setup(transfer->buffer, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_STRING << 8, 0, 1024 + LIBUSB_CONTROL_SETUP_SIZE);
+	libusb_fill_control_transfer(transfer, usbdev->dev, transfer->buffer, get_langid_callback, usbdev, 1000);
 
-	int desired_config = devdesc.bNumConfigurations;
-	if (desired_config > 4) {
-		if (desired_config > 5) {
-			usbmuxd_log(LL_ERROR, "Device %d-%d has more than 5 configurations, but usbmuxd doesn't support that. Choosing configuration 5 instead.", bus, address);
-			desired_config = 5;
-		}
-		/* verify if the configuration 5 is actually usable */
-		do {
-			struct libusb_config_descriptor *config;
-			const struct libusb_interface_descriptor *intf;
-			if (libusb_get_config_descriptor_by_value(dev, 5, &config) != 0) {
-				usbmuxd_log(LL_WARNING, "Device %d-%d: Failed to get config descriptor for configuration 5, choosing configuration 4 instead.", bus, address);
-				desired_config = 4;
-				break;
-			}
-			if (config->bNumInterfaces != 3) {
-				usbmuxd_log(LL_WARNING, "Device %d-%d: Ignoring possibly bad configuration 5, choosing configuration 4 instead.", bus, address);
-				desired_config = 4;
-				break;
-			}
-			intf = &config->interface[2].altsetting[0];
-			if (intf->bInterfaceClass != 0xFF || intf->bInterfaceSubClass != 0x2A || intf->bInterfaceProtocol != 0xFF) {
-				usbmuxd_log(LL_WARNING, "Device %d-%d: Ignoring possibly bad configuration 5, choosing configuration 4 instead.", bus, address);
-				desired_config = 4;
-				break;
-			}
-		} while (0);
+	if((res = libusb_submit_transfer(transfer)) < 0) {
+		usbmuxd_log(LL_ERROR, "Could not request transfer for device %d-%d: %s", usbdev->bus, usbdev->address, libusb_error_name(res));
+		return res;
 	}
+	usbdev->probe_xfer = transfer;
+	return 0;
+}
+
+/**
+ * Switch the device to the given configuration, detaching kernel drivers
+ * from the interfaces of the current one first. Blocking.
+ */
+static int usb_device_set_configuration(libusb_device *dev, libusb_device_handle *handle, uint8_t bus, uint8_t address, int desired_config)
+{
 	int current_config = 0;
+	int j, res;
+
 	if((res = libusb_get_configuration(handle, &current_config)) != 0) {
 		usbmuxd_log(LL_WARNING, "Could not get configuration for device %d-%d: %s", bus, address, libusb_error_name(res));
-		libusb_close(handle);
 		return -1;
 	}
 	if (current_config != desired_config) {
@@ -322,22 +443,63 @@ static int usb_device_add(libusb_device* dev)
 		usbmuxd_log(LL_INFO, "Setting configuration for device %d-%d, from %d to %d", bus, address, current_config, desired_config);
 		if((res = libusb_set_configuration(handle, desired_config)) != 0) {
 			usbmuxd_log(LL_WARNING, "Could not set configuration %d for device %d-%d: %s", desired_config, bus, address, libusb_error_name(res));
-			libusb_close(handle);
 			return -1;
 		}
 	}
 
+	return 0;
+}
+
+/**
+ * Full configuration probe: choose between configuration 4 and 5, find
+ * the mux interface and its endpoints and claim it. The result is
+ * remembered in the attach cache. Blocking, runs on a worker thread.
+ */
+static int usb_device_probe_configuration(struct usb_device *usbdev, libusb_device_handle *handle)
+{
+	libusb_device *dev = usbdev->device;
+	uint8_t bus = usbdev->bus;
+	uint8_t address = usbdev->address;
+	struct libusb_device_descriptor *devdesc = &usbdev->devdesc;
+	int j, res;
+
+	int desired_config = devdesc->bNumConfigurations;
+	if (desired_config > 4) {
+		if (desired_config > 5) {
+			usbmuxd_log(LL_ERROR, "Device %d-%d has more than 5 configurations, but usbmuxd doesn't support that. Choosing configuration 5 instead.", bus, address);
+			desired_config = 5;
+		}
+		/* verify if the configuration 5 is actually usable */
+		do {
+			struct libusb_config_descriptor *config;
+			const struct libusb_interface_descriptor *intf;
+			if (libusb_get_config_descriptor_by_value(dev, 5, &config) != 0) {
+				usbmuxd_log(LL_WARNING, "Device %d-%d: Failed to get config descriptor for configuration 5, choosing configuration 4 instead.", bus, address);
+				desired_config = 4;
+				break;
+			}
+			if (config->bNumInterfaces != 3) {
+				usbmuxd_log(LL_WARNING, "Device %d-%d: Ignoring possibly bad configuration 5, choosing configuration 4 instead.", bus, address);
+				desired_config = 4;
+				break;
+			}
+			intf = &config->interface[2].altsetting[0];
+			if (intf->bInterfaceClass != 0xFF || intf->bInterfaceSubClass != 0x2A || intf->bInterfaceProtocol != 0xFF) {
+				usbmuxd_log(LL_WARNING, "Device %d-%d: Ignoring possibly bad configuration 5, choosing configuration 4 instead.", bus, address);
+				desired_config = 4;
+				break;
+			}
+		} while (0);
+	}
+	if(usb_device_set_configuration(dev, handle, bus, address, desired_config) < 0)
+		return -1;
+
 	struct libusb_config_descriptor *config;
 	if((res = libusb_get_active_config_descriptor(dev, &config)) != 0) {
 		usbmuxd_log(LL_WARNING, "Could not get configuration descriptor for device %d-%d: %s", bus, address, libusb_error_name(res));
-		libusb_close(handle);
 		return -1;
 	}
 
-	struct usb_device *usbdev;
-	usbdev = malloc(sizeof(struct usb_device));
-	memset(usbdev, 0, sizeof(*usbdev));
-
 	for(j=0; j<config->bNumInterfaces; j++) {
 		const struct libusb_interface_descriptor *intf = &config->interface[j].altsetting[0];
 		if(intf->bInterfaceClass != INTERFACE_CLASS ||
@@ -370,8 +532,6 @@ static int usb_device_add(libusb_device* dev)
 	if(j == config->bNumInterfaces) {
 		usbmuxd_log(LL_WARNING, "Could not find a suitable USB interface for device %d-%d", bus, address);
 		libusb_free_config_descriptor(config);
-		libusb_close(handle);
-		free(usbdev);
 		return -1;
 	}
 
@@ -379,41 +539,98 @@ static int usb_device_add(libusb_device* dev)
 
 	if((res = libusb_claim_interface(handle, usbdev->interface)) != 0) {
 		usbmuxd_log(LL_WARNING, "Could not claim interface %d for device %d-%d: %s", usbdev->interface, bus, address, libusb_error_name(res));
-		libusb_close(handle);
-		free(usbdev);
 		return -1;
 	}
 
-	transfer = libusb_alloc_transfer(0);
-	if(!transfer) {
-		usbmuxd_log(LL_WARNING, "Failed to allocate transfer for device %d-%d: %s", bus, address, libusb_error_name(res));
-		libusb_close(handle);
-		free(usbdev);
+	usbdev->wMaxPacketSize = libusb_get_max_packet_size(dev, usbdev->ep_out);
+	if (usbdev->wMaxPacketSize <= 0) {
+		usbmuxd_log(LL_ERROR, "Could not determine wMaxPacketSize for device %d-%d, setting to 64", usbdev->bus, usbdev->address);
+		usbdev->wMaxPacketSize = 64;
+		// nothing to validate a cached entry against later
+		return 0;
+	}
+	usbmuxd_log(LL_INFO, "Using wMaxPacketSize=%d for device %d-%d", usbdev->wMaxPacketSize, usbdev->bus, usbdev->address);
+
+	usbdev->cache.config = desired_config;
+	usbdev->cache.interface = usbdev->interface;
+	usbdev->cache.ep_in = usbdev->ep_in;
+	usbdev->cache.ep_out = usbdev->ep_out;
+	usbdev->cache.wMaxPacketSize = usbdev->wMaxPacketSize;
+	usb_cache_store(&usbdev->cache);
+
+	return 0;
+}
+
+/**
+ * Configure the device from an attach cache entry, skipping the
+ * configuration 5 checks and the interface scan. The entry is only
+ * trusted if the claimed endpoint still has the cached packet size.
+ */
+static int usb_device_apply_cached_configuration(struct usb_device *usbdev, libusb_device_handle *handle, const struct usb_cache_entry *entry)
+{
+	libusb_device *dev = usbdev->device;
+	int res;
+
+	if(usb_device_set_configuration(dev, handle, usbdev->bus, usbdev->address, entry->config) < 0)
+		return -1;
+
+	if(libusb_get_max_packet_size(dev, entry->ep_out) != entry->wMaxPacketSize ||
+	   libusb_get_max_packet_size(dev, entry->ep_in) <= 0) {
+		usbmuxd_log(LL_NOTICE, "Cached endpoints %02x/%02x don't match configuration %d of device %d-%d", entry->ep_out, entry->ep_in, entry->config, usbdev->bus, usbdev->address);
 		return -1;
 	}
 
-	unsigned char *transfer_buffer = malloc(1024 + LIBUSB_CONTROL_SETUP_SIZE + 8);
-	if (!transfer_buffer) {
-		usbmuxd_log(LL_WARNING, "Failed to allocate transfer buffer for device %d-%d: %s", bus, address, libusb_error_name(res));
-		libusb_close(handle);
-		free(usbdev);
+	if((res = libusb_claim_interface(handle, entry->interface)) != 0) {
+		usbmuxd_log(LL_NOTICE, "Could not claim cached interface %d for device %d-%d: %s", entry->interface, usbdev->bus, usbdev->address, libusb_error_name(res));
 		return -1;
 	}
-	memset(transfer_buffer, '\0', 1024 + LIBUSB_CONTROL_SETUP_SIZE + 8);
 
-	usbdev->serial[0] = 0;
-	usbdev->bus = bus;
-	usbdev->address = address;
-	usbdev->devdesc = devdesc;
-	usbdev->speed = 480000000;
-	usbdev->dev = handle;
-	usbdev->alive = 1;
-	usbdev->wMaxPacketSize = libusb_get_max_packet_size(dev, usbdev->ep_out);
-	if (usbdev->wMaxPacketSize <= 0) {
-		usbmuxd_log(LL_ERROR, "Could not determine wMaxPacketSize for device %d-%d, setting to 64", usbdev->bus, usbdev->address);
-		usbdev->wMaxPacketSize = 64;
-	} else {
-		usbmuxd_log(LL_INFO, "Using wMaxPacketSize=%d for device %d-%d", usbdev->wMaxPacketSize, usbdev->bus, usbdev->address);
+	usbdev->interface = entry->interface;
+	usbdev->ep_in = entry->ep_in;
+	usbdev->ep_out = entry->ep_out;
+	usbdev->wMaxPacketSize = entry->wMaxPacketSize;
+	usbmuxd_log(LL_INFO, "Using cached configuration %d, interface %d with endpoints %02x/%02x for device %d-%d", entry->config, usbdev->interface, usbdev->ep_out, usbdev->ep_in, usbdev->bus, usbdev->address);
+	return 0;
+}
+
+/**
+ * Configure a freshly attached device: open it, select the desired
+ * configuration and claim the mux interface. These operations block,
+ * so this runs on a worker thread; only the fields of usbdev that the
+ * main thread does not touch while the device is in the
+ * USBDEV_CONFIGURING state may be written here.
+ */
+static void usb_device_configure(void *data)
+{
+	struct usb_device *usbdev = data;
+	libusb_device *dev = usbdev->device;
+	uint8_t bus = usbdev->bus;
+	uint8_t address = usbdev->address;
+	struct usb_cache_entry entry;
+	libusb_device_handle *handle;
+	int res;
+
+	usbdev->configure_result = -1;
+
+	if((res = libusb_open(dev, &handle)) != 0) {
+		usbmuxd_log(LL_WARNING, "Could not open device %d-%d: %s", bus, address, libusb_error_name(res));
+		return;
+	}
+
+	entry = usbdev->cache;
+	res = -1;
+	if(usb_cache_lookup(&entry) == 0) {
+		res = usb_device_apply_cached_configuration(usbdev, handle, &entry);
+		if(res < 0) {
+			usbmuxd_log(LL_NOTICE, "Attach cache entry for device %d-%d is stale, probing again", bus, address);
+			usb_cache_invalidate(&usbdev->cache);
+		} else {
+			usbdev->cache.langid = entry.langid;
+		}
+	}
+	if(res < 0 && usb_device_probe_configuration(usbdev, handle) < 0) {
+		libusb_close(handle);
+		return;
 	}
 
 	switch (libusb_get_device_speed(dev)) {
@@ -435,26 +652,151 @@ static int usb_device_add(libusb_device* dev)
 
 	usbmuxd_log(LL_INFO, "USB Speed is %g MBit/s for device %d-%d", (double)(usbdev->speed / 1000000.0), usbdev->bus, usbdev->address);
 
-	/**
-	 * From libusb:
-	 * 	Asking for the zero'th index is special - it returns a string
-	 * 	descriptor that contains all the language IDs supported by the
-	 * 	device.
-	 **/
-	libusb_fill_control_setup(transfer_buffer, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_STRING << 8, 0, 1024 + LIBUSB_CONTROL_SETUP_SIZE);
-	libusb_fill_control_transfer(transfer, handle, transfer_buffer, get_langid_callback, usbdev, 1000);
+	usbdev->dev = handle;
+	usbdev->configure_result = 0;
+}
 
-	if((res = libusb_submit_transfer(transfer)) < 0) {
-		usbmuxd_log(LL_ERROR, "Could not request transfer for device %d-%d: %s", usbdev->bus, usbdev->address, libusb_error_name(res));
+/**
+ * Called on the main thread once a worker has finished configuring the
+ * device. Continues the bring-up by asynchronously requesting the
+ * string descriptors that contain the serial number.
+ */
+static void usb_device_configured(void *data)
+{
+	struct usb_device *usbdev = data;
+	struct libusb_transfer *transfer;
+	int res;
+
+	libusb_unref_device(usbdev->device);
+	usbdev->device = NULL;
+
+	if(!usbdev->alive) {
+		usbmuxd_log(LL_INFO, "Device %d-%d went away while it was being configured", usbdev->bus, usbdev->address);
+		usb_device_free(usbdev);
+		return;
+	}
+	if(usbdev->configure_result < 0) {
+		usb_device_free(usbdev);
+		return;
+	}
+
+	transfer = libusb_alloc_transfer(0);
+	if(!transfer) {
+		usbmuxd_log(LL_WARNING, "Failed to allocate transfer for device %d-%d", usbdev->bus, usbdev->address);
+		usb_device_free(usbdev);
+		return;
+	}
+
+	unsigned char *transfer_buffer = malloc(1024 + LIBUSB_CONTROL_SETUP_SIZE + 8);
+	if (!transfer_buffer) {
+		usbmuxd_log(LL_WARNING, "Failed to allocate transfer buffer for device %d-%d", usbdev->bus, usbdev->address);
 		libusb_free_transfer(transfer);
-		libusb_close(handle);
-		free(transfer_buffer);
-		free(usbdev);
+		usb_device_free(usbdev);
+		return;
+	}
+	memset(transfer_buffer, '\0', 1024 + LIBUSB_CONTROL_SETUP_SIZE + 8);
+	transfer->buffer = transfer_buffer;
+	transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
+
+	// with a known language ID the serial number can be requested right away
+	if(usbdev->cache.langid) {
+		usbmuxd_log(LL_INFO, "Using cached lang ID %u for device %d-%d", usbdev->cache.langid, usbdev->bus, usbdev->address);
+		usbdev->langid_cached = 1;
+		res = usb_device_request_serial(usbdev, transfer, usbdev->cache.langid);
+	} else {
+		res = usb_device_request_langid(usbdev, transfer);
+	}
+	if(res < 0) {
+		libusb_free_transfer(transfer);
+		usb_device_free(usbdev);
+		return;
+	}
+
+	usbdev->state = USBDEV_PROBING;
+}
+
+/**
+ * The attach cache is keyed by the physical port the device is plugged
+ * into, not by its address, which changes on every re-plug.
+ */
+static void usb_device_set_cache_key(struct usb_device *usbdev, libusb_device *dev)
+{
+	uint8_t ports[7];
+	int i, num_ports;
+	char *p = usbdev->cache.port_path;
+	char *end = p + sizeof(usbdev->cache.port_path);
+
+	p += snprintf(p, end - p, "%d", usbdev->bus);
+	num_ports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	for(i = 0; i < num_ports && p < end; i++) {
+		p += snprintf(p, end - p, "%c%d", (i == 0) ? '-' : '.', ports[i]);
+	}
+	usbdev->cache.vid = usbdev->devdesc.idVendor;
+	usbdev->cache.pid = usbdev->devdesc.idProduct;
+	usbdev->cache.serial_index = usbdev->devdesc.iSerialNumber;
+}
+
+static int usb_device_add(libusb_device* dev)
+{
+	int res;
+	// the following are non-blocking operations on the device list
+	uint8_t bus = libusb_get_bus_number(dev);
+	uint8_t address = libusb_get_device_address(dev);
+	struct libusb_device_descriptor devdesc;
+	int found = 0;
+	FOREACH(struct usb_device *usbdev, &device_list) {
+		if(usbdev->bus == bus && usbdev->address == address) {
+			usbdev->alive = 1;
+			found = 1;
+			break;
+		}
+	} ENDFOREACH
+	if(found)
+		return 0; //device already found
+
+	if((res = libusb_get_device_descriptor(dev, &devdesc)) != 0) {
+		usbmuxd_log(LL_WARNING, "Could not get device descriptor for device %d-%d: %s", bus, address, libusb_error_name(res));
 		return -1;
 	}
+	if(devdesc.idVendor != VID_APPLE)
+		return -1;
+	if((devdesc.idProduct != PID_APPLE_T2_COPROCESSOR) &&
+		((devdesc.idProduct < PID_RANGE_LOW) ||
+		(devdesc.idProduct > PID_RANGE_MAX)))
+		return -1;
+	usbmuxd_log(LL_INFO, "Found new device with v/p %04x:%04x at %d-%d", devdesc.idVendor, devdesc.idProduct, bus, address);
+
+	struct usb_device *usbdev;
+	usbdev = malloc(sizeof(struct usb_device));
+	memset(usbdev, 0, sizeof(*usbdev));
+
+	usbdev->serial[0] = 0;
+	usbdev->bus = bus;
+	usbdev->address = address;
+	usbdev->devdesc = devdesc;
+	usbdev->speed = 480000000;
+	usbdev->dev = NULL;
+	usbdev->alive = 1;
+	usbdev->transport = &usb_libusb_transport;
+	usbdev->usbfs_fd = -1;
+	usbdev->state = USBDEV_CONFIGURING;
+	usbdev->device = libusb_ref_device(dev);
+	usb_device_set_cache_key(usbdev, dev);
 
 	collection_init(&usbdev->tx_xfers);
 	collection_init(&usbdev->rx_xfers);
+	collection_init(&usbdev->recovery.tx_stalled);
+
+	// No blocking operation can follow: it may be run in the libusb hotplug callback and libusb will refuse any
+	// blocking call. Configuring the device is left to the worker pool.
+	if(worker_queue(usb_device_configure, usb_device_configured, usbdev) < 0) {
+		usbmuxd_log(LL_ERROR, "Could not queue configuration of device %d-%d", bus, address);
+		libusb_unref_device(usbdev->device);
+		collection_free(&usbdev->tx_xfers);
+		collection_free(&usbdev->rx_xfers);
+		free(usbdev);
+		return -1;
+	}
 
 	collection_add(&device_list, usbdev);
 
@@ -516,6 +858,65 @@ int usb_discover(void)
 	return valid_count;
 }
 
+#if defined(HAVE_LIBUSB_HOTPLUG_API) || defined(HAVE_LIBUDEV)
+static void usb_device_left(uint8_t bus, uint8_t address)
+{
+	FOREACH(struct usb_device *usbdev, &device_list) {
+		if(usbdev->bus == bus && usbdev->address == address) {
+			usbdev->alive = 0;
+			device_remove(usbdev);
+			break;
+		}
+	} ENDFOREACH
+}
+#endif
+
+#ifdef HAVE_LIBUDEV
+static int device_udev = 0;
+
+// add the one device an udev event was about
+static void usb_discover_one(uint8_t bus, uint8_t address)
+{
+	libusb_device **devs;
+	int cnt, i;
+
+	cnt = libusb_get_device_list(NULL, &devs);
+	if(cnt < 0) {
+		usbmuxd_log(LL_WARNING, "Could not get device list: %d", cnt);
+		return;
+	}
+	for(i = 0; i < cnt; i++) {
+		if(libusb_get_bus_number(devs[i]) == bus && libusb_get_device_address(devs[i]) == address) {
+			usb_device_add(devs[i]);
+			break;
+		}
+	}
+	libusb_free_device_list(devs, 1);
+}
+
+static void udev_process(void)
+{
+	enum usb_udev_action action;
+	uint8_t bus, address;
+	int res;
+
+	if(!device_udev)
+		return;
+	while((res = usb_udev_receive(&action, &bus, &address)) > 0) {
+		if(action == USB_UDEV_ADD) {
+			if(device_hotplug)
+				usb_discover_one(bus, address);
+		} else {
+			usb_device_left(bus, address);
+		}
+	}
+	if(res < 0) {
+		// some events were dropped, find out what we missed
+		usb_discover();
+	}
+}
+#endif
+
 void usb_add_pollfds(struct fdlist *list)
 {
 	const struct libusb_pollfd **usbfds;
@@ -531,15 +932,47 @@ void usb_add_pollfds(struct fdlist *list)
 		p++;
 	}
 	free(usbfds);
+
+	// finished device configurations are reported through this one
+	fdlist_add_usb_fd(list, worker_get_fd(), POLLIN);
+
+#ifdef HAVE_LINUX_USBDEVICE_FS_H
+	FOREACH(struct usb_device *usbdev, &device_list) {
+		usb_usbfs_add_pollfd(list, usbdev);
+	} ENDFOREACH
+#endif
+
+#ifdef HAVE_LIBUDEV
+	if(device_udev)
+		fdlist_add_usb_fd(list, usb_udev_get_fd(), POLLIN);
+#endif
+
+	usb_sim_add_pollfds(list);
 }
 
 void usb_autodiscover(int enable)
 {
 	usbmuxd_log(LL_DEBUG, "usb polling enable: %d", enable);
 	device_polling = enable;
+#ifdef HAVE_LIBUDEV
+	// udev tells us about new devices, no need to poll for them
+	if(device_udev)
+		device_polling = 0;
+#endif
 	device_hotplug = enable;
 }
 
+void usb_use_usbfs(int enable)
+{
+#ifdef HAVE_LINUX_USBDEVICE_FS_H
+	usbmuxd_log(LL_DEBUG, "usbfs backend enable: %d", enable);
+	device_usbfs = enable;
+#else
+	if(enable)
+		usbmuxd_log(LL_WARNING, "usbfs backend not available, using libusb");
+#endif
+}
+
 static int dev_poll_remain_ms(void)
 {
 	int msecs;
@@ -559,8 +992,11 @@ int usb_get_timeout(void)
 	struct timeval tv;
 	int msec;
 	int res;
-	int pollrem;
+	int pollrem, simrem;
 	pollrem = dev_poll_remain_ms();
+	simrem = usb_sim_get_timeout();
+	if(simrem < pollrem)
+		pollrem = simrem;
 	res = libusb_get_next_timeout(NULL, &tv);
 	if(res == 0)
 		return pollrem;
@@ -579,6 +1015,10 @@ int usb_process(void)
 {
 	int res;
 	struct timeval tv;
+
+	// continue the bring-up of devices that workers finished configuring
+	worker_process();
+
 	tv.tv_sec = tv.tv_usec = 0;
 	res = libusb_handle_events_timeout(NULL, &tv);
 	if(res < 0) {
@@ -586,6 +1026,15 @@ int usb_process(void)
 		return res;
 	}
 
+	usbfs_process();
+	usb_sim_process();
+#ifdef HAVE_LIBUDEV
+	udev_process();
+#endif
+
+	// ACK and flush everything received during this pass at once
+	device_rx_flush();
+
 	// reap devices marked dead due to an RX error
 	reap_dead_devices();
 
@@ -620,6 +1069,9 @@ int usb_process_timeout(int msec)
 			usbmuxd_log(LL_ERROR, "libusb_handle_events_timeout failed: %s", libusb_error_name(res));
 			return res;
 		}
+		usbfs_process();
+		usb_sim_process();
+		device_rx_flush();
 		// reap devices marked dead due to an RX error
 		reap_dead_devices();
 		get_tick_count(&tcur);
@@ -637,15 +1089,7 @@ static int usb_hotplug_cb(libusb_context *ctx, libusb_device *device, libusb_hot
 			usb_device_add(device);
 		}
 	} else if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == event) {
-		uint8_t bus = libusb_get_bus_number(device);
-		uint8_t address = libusb_get_device_address(device);
-		FOREACH(struct usb_device *usbdev, &device_list) {
-			if(usbdev->bus == bus && usbdev->address == address) {
-				usbdev->alive = 0;
-				device_remove(usbdev);
-				break;
-			}
-		} ENDFOREACH
+		usb_device_left(libusb_get_bus_number(device), libusb_get_device_address(device));
 	} else {
 		usbmuxd_log(LL_ERROR, "Unhandled event %d", event);
 	}
@@ -675,6 +1119,12 @@ int usb_init(void)
 #endif
 
 	collection_init(&device_list);
+	usb_bus_init();
+
+	if (worker_init(NUM_CONFIG_WORKERS) < 0) {
+		libusb_exit(NULL);
+		return -1;
+	}
 
 #ifdef HAVE_LIBUSB_HOTPLUG_API
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
@@ -688,6 +1138,11 @@ int usb_init(void)
 	} else {
 		usbmuxd_log(LL_ERROR, "libusb does not support hotplug events");
 	}
+#endif
+#ifdef HAVE_LIBUDEV
+	if (device_polling && usb_udev_init() == 0) {
+		device_udev = 1;
+	}
 #endif
 	if (device_polling) {
 		res = usb_discover();
@@ -696,6 +1151,15 @@ int usb_init(void)
 	} else {
 		res = collection_count(&device_list);
 	}
+#ifdef HAVE_LIBUDEV
+	// the initial scan was the only full one, udev reports the rest
+	if (device_udev) {
+		device_polling = 0;
+	}
+#endif
+	if (res >= 0) {
+		res += usb_sim_init();
+	}
 	return res;
 }
 
@@ -707,10 +1171,50 @@ void usb_shutdown(void)
 	libusb_hotplug_deregister_callback(NULL, usb_hotplug_cb_handle);
 #endif
 
+	usb_sim_shutdown();
+#ifdef HAVE_LIBUDEV
+	if (device_udev) {
+		usb_udev_shutdown();
+		device_udev = 0;
+	}
+#endif
+
+	// wait for running configurations, drop the queued ones
+	worker_shutdown();
+
 	FOREACH(struct usb_device *usbdev, &device_list) {
+		if(usbdev->state == USBDEV_CONFIGURING) {
+			usb_device_free(usbdev);
+			continue;
+		}
+		// halt recoveries were dropped along with the queue
+		usbdev->recovery.pending = 0;
 		device_remove(usbdev);
-		usb_disconnect(usbdev);
+		usb_device_disconnect(usbdev);
 	} ENDFOREACH
+
+	// all devices are cancelled in parallel, now wait for the callbacks
+	while(collection_count(&device_list) > 0) {
+		struct timeval tv;
+		int res;
+
+		usbfs_process();
+		FOREACH(struct usb_device *usbdev, &device_list) {
+			if(usb_device_disconnect_finished(usbdev)) {
+				usb_device_free(usbdev);
+			}
+		} ENDFOREACH
+		if(collection_count(&device_list) == 0)
+			break;
+
+		tv.tv_sec = 0;
+		tv.tv_usec = 10000;
+		if((res = libusb_handle_events_timeout(NULL, &tv)) < 0) {
+			usbmuxd_log(LL_ERROR, "libusb_handle_events_timeout for usb_shutdown failed: %s", libusb_error_name(res));
+			break;
+		}
+	}
 	collection_free(&device_list);
+	usb_bus_shutdown();
 	libusb_exit(NULL);
 }
@@ -44,12 +44,16 @@
 #define PID_RANGE_MAX 0x12af
 #define PID_APPLE_T2_COPROCESSOR 0x8600
 
+struct usb_device;
+
 int usb_init(void);
 void usb_shutdown(void);
 void usb_add_pollfds(struct fdlist *list);
 int usb_get_timeout(void);
 int usb_discover(void);
 void usb_autodiscover(int enable);
+void usb_use_usbfs(int enable);
+int usb_rx_resubmit_allowed(struct usb_device *dev, int xfers);
 int usb_process(void);
 int usb_process_timeout(int msec);
 
@@ -0,0 +1,286 @@
+/*
+ * usb_bus.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usb_bus.h"
+#include "usb_device.h"
+#include "collection.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * Devices behind the same root port share one link to the host, so one
+ * busy device can starve its neighbours. Devices are grouped by bus and
+ * root port (the start of their port path), and each group splits two
+ * budgets between its members: the bytes of mux packets in flight, see
+ * usb_device_send(), and the number of RX transfers kept posted. Shares
+ * are equal unless weights are configured per serial number. The TX
+ * budget only goes to members that have something to send, so a device
+ * on its own keeps the full USB_TX_MAX_IN_FLIGHT.
+ *
+ * The host controller still schedules the endpoints; the arbiter only
+ * keeps a device from queueing more work on the link than its share.
+ * Everything here runs on the main thread.
+ */
+
+struct usb_bus {
+	char name[16];
+	struct collection members;	// struct usb_device
+	uint64_t rx_bytes_gone, tx_bytes_gone;	// moved by members that left
+	uint64_t sample_time;
+	uint64_t sample_bytes;
+};
+
+struct bus_weight {
+	char *serial;
+	int weight;
+};
+
+static struct collection bus_list;
+static struct collection weight_list;
+
+/**
+ * Give a device a larger share of its bus.
+ *
+ * @param spec SERIAL=WEIGHT, with WEIGHT between 1 and 64
+ * @return 0 on success, a negative value if spec is invalid
+ */
+int usb_bus_add_weight(const char *spec)
+{
+	const char *sep = strrchr(spec, '=');
+	char *end = NULL;
+	long weight;
+
+	if(!weight_list.list)
+		collection_init(&weight_list);
+
+	if(!sep || sep == spec) {
+		usbmuxd_log(LL_FATAL, "ERROR: bus share '%s' is not SERIAL=WEIGHT", spec);
+		return -1;
+	}
+	weight = strtol(sep + 1, &end, 10);
+	if(end == sep + 1 || *end || weight < 1 || weight > 64) {
+		usbmuxd_log(LL_FATAL, "ERROR: bus share weight in '%s' must be between 1 and 64", spec);
+		return -1;
+	}
+	struct bus_weight *w = malloc(sizeof(struct bus_weight));
+	w->serial = malloc(sep - spec + 1);
+	memcpy(w->serial, spec, sep - spec);
+	w->serial[sep - spec] = '\0';
+	w->weight = (int)weight;
+	collection_add(&weight_list, w);
+	return 0;
+}
+
+void usb_bus_init(void)
+{
+	collection_init(&bus_list);
+	if(!weight_list.list)
+		collection_init(&weight_list);
+}
+
+void usb_bus_shutdown(void)
+{
+	FOREACH(struct usb_bus *bus, &bus_list) {
+		collection_free(&bus->members);
+		free(bus);
+	} ENDFOREACH
+	collection_free(&bus_list);
+	FOREACH(struct bus_weight *w, &weight_list) {
+		free(w->serial);
+		free(w);
+	} ENDFOREACH
+	collection_free(&weight_list);
+}
+
+static void bus_name(struct usb_device *dev, char *name, size_t size)
+{
+	// "3-1.4.2" -> "3-1"
+	const char *path = dev->cache.port_path;
+	size_t len = strcspn(path, ".");
+	if(!len) {
+		snprintf(name, size, "%d", dev->bus);
+		return;
+	}
+	if(len >= size)
+		len = size - 1;
+	memcpy(name, path, len);
+	name[len] = '\0';
+}
+
+static int lookup_weight(const char *serial)
+{
+	FOREACH(struct bus_weight *w, &weight_list) {
+		if(!strcmp(w->serial, serial))
+			return w->weight;
+	} ENDFOREACH
+	return 1;
+}
+
+void usb_bus_add(struct usb_device *dev)
+{
+	struct usb_bus *found = NULL;
+	char name[16];
+
+	if(dev->bus_group)
+		return;
+	bus_name(dev, name, sizeof(name));
+	FOREACH(struct usb_bus *bus, &bus_list) {
+		if(!strcmp(bus->name, name)) {
+			found = bus;
+			break;
+		}
+	} ENDFOREACH
+	if(!found) {
+		found = malloc(sizeof(struct usb_bus));
+		memset(found, 0, sizeof(struct usb_bus));
+		strcpy(found->name, name);
+		collection_init(&found->members);
+		collection_add(&bus_list, found);
+	}
+	dev->bus_group = found;
+	dev->bus_weight = lookup_weight(dev->serial);
+	collection_add(&found->members, dev);
+	usbmuxd_log(LL_INFO, "Device %d-%d shares bus %s with %d other device(s), weight %d",
+		dev->bus, dev->address, found->name, collection_count(&found->members) - 1, dev->bus_weight);
+}
+
+void usb_bus_remove(struct usb_device *dev)
+{
+	struct usb_bus *bus = dev->bus_group;
+	if(!bus)
+		return;
+	dev->bus_group = NULL;
+	collection_remove(&bus->members, dev);
+	if(collection_count(&bus->members) == 0) {
+		collection_remove(&bus_list, bus);
+		collection_free(&bus->members);
+		free(bus);
+		return;
+	}
+	bus->rx_bytes_gone += dev->rx_stats.bytes;
+	bus->tx_bytes_gone += dev->tx_stats.bytes;
+}
+
+/**
+ * How many bytes of mux packets dev may have in flight right now: its
+ * weighted part of USB_BUS_TX_BUDGET among the members of its bus that
+ * have TX work, itself included.
+ */
+uint64_t usb_bus_tx_limit(struct usb_device *dev)
+{
+	struct usb_bus *bus = dev->bus_group;
+	uint64_t limit;
+	int active;
+
+	if(!bus)
+		return USB_TX_MAX_IN_FLIGHT;
+	active = dev->bus_weight;
+	FOREACH(struct usb_device *other, &bus->members) {
+		if(other != dev && (other->tx_stats.in_flight_bytes || other->tx_queue_head))
+			active += other->bus_weight;
+	} ENDFOREACH
+	limit = (uint64_t)USB_BUS_TX_BUDGET * dev->bus_weight / active;
+	if(limit < USB_BUS_TX_MIN_SHARE)
+		limit = USB_BUS_TX_MIN_SHARE;
+	if(limit > USB_TX_MAX_IN_FLIGHT)
+		limit = USB_TX_MAX_IN_FLIGHT;
+	return limit;
+}
+
+/**
+ * How many RX transfers dev should keep posted: its weighted part of
+ * USB_BUS_RX_BUDGET, at least 1 and at most max.
+ */
+int usb_bus_rx_share(struct usb_device *dev, int max)
+{
+	struct usb_bus *bus = dev->bus_group;
+	int total = 0;
+	int share;
+
+	if(!bus)
+		return max;
+	FOREACH(struct usb_device *other, &bus->members) {
+		total += other->bus_weight;
+	} ENDFOREACH
+	share = USB_BUS_RX_BUDGET * dev->bus_weight / total;
+	if(share < 1)
+		share = 1;
+	if(share > max)
+		share = max;
+	return share;
+}
+
+/**
+ * Get the members and utilization of every bus that has devices. The
+ * throughput is averaged over the time since the previous call.
+ *
+ * @return number of entries in stats, to be freed with
+ *   usb_bus_free_stats()
+ */
+int usb_bus_get_stats(struct usb_bus_stats **stats)
+{
+	int count = collection_count(&bus_list);
+	int i = 0;
+	uint64_t now = mstime64();
+
+	*stats = malloc(sizeof(struct usb_bus_stats) * (count ? count : 1));
+	memset(*stats, 0, sizeof(struct usb_bus_stats) * (count ? count : 1));
+	FOREACH(struct usb_bus *bus, &bus_list) {
+		struct usb_bus_stats *s = &(*stats)[i++];
+		int j = 0;
+		strcpy(s->name, bus->name);
+		s->rx_bytes = bus->rx_bytes_gone;
+		s->tx_bytes = bus->tx_bytes_gone;
+		s->members = malloc(sizeof(struct usb_bus_member_stats) * collection_count(&bus->members));
+		FOREACH(struct usb_device *dev, &bus->members) {
+			struct usb_bus_member_stats *m = &s->members[j++];
+			strcpy(m->serial, dev->serial);
+			m->weight = dev->bus_weight;
+			m->tx_limit = usb_bus_tx_limit(dev);
+			m->in_flight_bytes = dev->tx_stats.in_flight_bytes;
+			m->rx_transfers = collection_count(&dev->rx_xfers);
+			s->rx_bytes += dev->rx_stats.bytes;
+			s->tx_bytes += dev->tx_stats.bytes;
+			if(dev->speed > s->speed)
+				s->speed = dev->speed;
+		} ENDFOREACH
+		s->num_members = j;
+		if(bus->sample_time && now > bus->sample_time)
+			s->throughput = (s->rx_bytes + s->tx_bytes - bus->sample_bytes) * 1000 / (now - bus->sample_time);
+		if(s->speed)
+			s->utilization = (uint32_t)(s->throughput * 8 * 100 / s->speed);
+		bus->sample_time = now;
+		bus->sample_bytes = s->rx_bytes + s->tx_bytes;
+	} ENDFOREACH
+	return count;
+}
+
+void usb_bus_free_stats(struct usb_bus_stats *stats, int count)
+{
+	int i;
+	for(i = 0; i < count; i++)
+		free(stats[i].members);
+	free(stats);
+}
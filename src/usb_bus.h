@@ -0,0 +1,61 @@
+/*
+ * usb_bus.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef USB_BUS_H
+#define USB_BUS_H
+
+#include <stdint.h>
+
+// bytes of mux packets all busy devices behind one root port may have in
+// flight together, as much as a single device may have on its own
+#define USB_BUS_TX_BUDGET (256 * 1024)
+// no device gets less than this, whatever its weight
+#define USB_BUS_TX_MIN_SHARE (64 * 1024)
+// RX transfers kept posted by all devices behind one root port
+#define USB_BUS_RX_BUDGET 6
+
+struct usb_device;
+
+struct usb_bus_member_stats {
+	char serial[256];
+	int weight;
+	uint64_t tx_limit;
+	uint64_t in_flight_bytes;
+	int rx_transfers;
+};
+
+struct usb_bus_stats {
+	char name[16];	// bus and root port, e.g. "3-1"
+	uint64_t speed;	// bit/s of the fastest member
+	uint64_t rx_bytes, tx_bytes;
+	uint64_t throughput;	// bytes/s since the previous query
+	uint32_t utilization;	// throughput in percent of speed
+	int num_members;
+	struct usb_bus_member_stats *members;
+};
+
+int usb_bus_add_weight(const char *spec);
+void usb_bus_init(void);
+void usb_bus_shutdown(void);
+void usb_bus_add(struct usb_device *dev);
+void usb_bus_remove(struct usb_device *dev);
+uint64_t usb_bus_tx_limit(struct usb_device *dev);
+int usb_bus_rx_share(struct usb_device *dev, int max);
+int usb_bus_get_stats(struct usb_bus_stats **stats);
+void usb_bus_free_stats(struct usb_bus_stats *stats, int count);
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * usb_cache.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <plist/plist.h>
+
+#include "usb_cache.h"
+#include "collection.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * Remembers what probing a device on a given port found, so that a
+ * re-plugged or reset device can skip the configuration 5 checks, the
+ * interface scan and the language ID request. Entries are only hints:
+ * the caller validates them against the device and invalidates the
+ * entry when they do not match. Lookups happen on the configuration
+ * workers as well as on the main thread, hence the mutex.
+ */
+
+static struct collection cache_list;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct usb_cache_stats cache_stats;
+static char *cache_filename = NULL;
+
+static int key_equal(const struct usb_cache_entry *a, const struct usb_cache_entry *b)
+{
+	return a->vid == b->vid && a->pid == b->pid && a->serial_index == b->serial_index
+		&& !strcmp(a->port_path, b->port_path);
+}
+
+// must be called with cache_mutex held
+static struct usb_cache_entry *find_entry(const struct usb_cache_entry *key)
+{
+	FOREACH(struct usb_cache_entry *entry, &cache_list) {
+		if(key_equal(entry, key))
+			return entry;
+	} ENDFOREACH
+	return NULL;
+}
+
+static uint64_t dict_get_uint(plist_t dict, const char *key)
+{
+	uint64_t val = 0;
+	plist_t node = plist_dict_get_item(dict, key);
+	if(node && plist_get_node_type(node) == PLIST_UINT)
+		plist_get_uint_val(node, &val);
+	return val;
+}
+
+static void cache_load(void)
+{
+	plist_t list = NULL;
+	uint32_t i;
+
+	if(!plist_read_from_filename(&list, cache_filename) || !list) {
+		usbmuxd_log(LL_INFO, "No attach cache loaded from %s", cache_filename);
+		return;
+	}
+	if(plist_get_node_type(list) != PLIST_ARRAY) {
+		usbmuxd_log(LL_WARNING, "Ignoring malformed attach cache %s", cache_filename);
+		plist_free(list);
+		return;
+	}
+	for(i = 0; i < plist_array_get_size(list); i++) {
+		plist_t dict = plist_array_get_item(list, i);
+		plist_t node = plist_dict_get_item(dict, "PortPath");
+		char *port_path = NULL;
+		if(!node || plist_get_node_type(node) != PLIST_STRING)
+			continue;
+		plist_get_string_val(node, &port_path);
+		if(!port_path)
+			continue;
+		struct usb_cache_entry *entry = malloc(sizeof(struct usb_cache_entry));
+		memset(entry, 0, sizeof(*entry));
+		strncpy(entry->port_path, port_path, sizeof(entry->port_path) - 1);
+		free(port_path);
+		entry->vid = (uint16_t)dict_get_uint(dict, "VendorID");
+		entry->pid = (uint16_t)dict_get_uint(dict, "ProductID");
+		entry->serial_index = (uint8_t)dict_get_uint(dict, "SerialIndex");
+		entry->langid = (uint16_t)dict_get_uint(dict, "LangID");
+		entry->config = (int)dict_get_uint(dict, "Configuration");
+		entry->interface = (uint8_t)dict_get_uint(dict, "Interface");
+		entry->ep_in = (uint8_t)dict_get_uint(dict, "EndpointIn");
+		entry->ep_out = (uint8_t)dict_get_uint(dict, "EndpointOut");
+		entry->wMaxPacketSize = (int)dict_get_uint(dict, "MaxPacketSize");
+		if(entry->config <= 0 || entry->wMaxPacketSize <= 0 || find_entry(entry)) {
+			free(entry);
+			continue;
+		}
+		collection_add(&cache_list, entry);
+	}
+	plist_free(list);
+	usbmuxd_log(LL_INFO, "Loaded %d attach cache entries from %s", collection_count(&cache_list), cache_filename);
+}
+
+static void cache_save(void)
+{
+	plist_t list = plist_new_array();
+	FOREACH(struct usb_cache_entry *entry, &cache_list) {
+		plist_t dict = plist_new_dict();
+		plist_dict_set_item(dict, "PortPath", plist_new_string(entry->port_path));
+		plist_dict_set_item(dict, "VendorID", plist_new_uint(entry->vid));
+		plist_dict_set_item(dict, "ProductID", plist_new_uint(entry->pid));
+		plist_dict_set_item(dict, "SerialIndex", plist_new_uint(entry->serial_index));
+		plist_dict_set_item(dict, "LangID", plist_new_uint(entry->langid));
+		plist_dict_set_item(dict, "Configuration", plist_new_uint(entry->config));
+		plist_dict_set_item(dict, "Interface", plist_new_uint(entry->interface));
+		plist_dict_set_item(dict, "EndpointIn", plist_new_uint(entry->ep_in));
+		plist_dict_set_item(dict, "EndpointOut", plist_new_uint(entry->ep_out));
+		plist_dict_set_item(dict, "MaxPacketSize", plist_new_uint(entry->wMaxPacketSize));
+		plist_array_append_item(list, dict);
+	} ENDFOREACH
+	if(!plist_write_to_filename(list, cache_filename)) {
+		usbmuxd_log(LL_WARNING, "Could not write attach cache to %s", cache_filename);
+	}
+	plist_free(list);
+}
+
+/**
+ * Initialize the attach cache. If filename is not NULL, entries are
+ * loaded from it now and written back by usb_cache_shutdown().
+ */
+void usb_cache_init(const char *filename)
+{
+	collection_init(&cache_list);
+	memset(&cache_stats, 0, sizeof(cache_stats));
+	if(filename) {
+		cache_filename = strdup(filename);
+		cache_load();
+	}
+}
+
+void usb_cache_shutdown(void)
+{
+	usbmuxd_log(LL_INFO, "Attach cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " invalidations",
+		cache_stats.hits, cache_stats.misses, cache_stats.invalidations);
+	if(cache_filename) {
+		cache_save();
+		free(cache_filename);
+		cache_filename = NULL;
+	}
+	FOREACH(struct usb_cache_entry *entry, &cache_list) {
+		free(entry);
+	} ENDFOREACH
+	collection_free(&cache_list);
+}
+
+/**
+ * Look up the entry matching the key fields of entry and copy it there.
+ *
+ * @return 0 on a cache hit, -1 on a miss
+ */
+int usb_cache_lookup(struct usb_cache_entry *entry)
+{
+	int res = -1;
+	pthread_mutex_lock(&cache_mutex);
+	struct usb_cache_entry *cached = find_entry(entry);
+	if(cached) {
+		*entry = *cached;
+		cache_stats.hits++;
+		res = 0;
+	} else {
+		cache_stats.misses++;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	return res;
+}
+
+void usb_cache_store(const struct usb_cache_entry *entry)
+{
+	pthread_mutex_lock(&cache_mutex);
+	struct usb_cache_entry *cached = find_entry(entry);
+	uint16_t langid = entry->langid;
+	if(!cached) {
+		cached = malloc(sizeof(struct usb_cache_entry));
+		collection_add(&cache_list, cached);
+	} else if(!langid) {
+		// a full configuration probe doesn't know the language ID, keep the old one
+		langid = cached->langid;
+	}
+	*cached = *entry;
+	cached->langid = langid;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+void usb_cache_set_langid(const struct usb_cache_entry *key, uint16_t langid)
+{
+	pthread_mutex_lock(&cache_mutex);
+	struct usb_cache_entry *cached = find_entry(key);
+	if(cached)
+		cached->langid = langid;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+void usb_cache_invalidate(const struct usb_cache_entry *key)
+{
+	pthread_mutex_lock(&cache_mutex);
+	struct usb_cache_entry *cached = find_entry(key);
+	if(cached) {
+		collection_remove(&cache_list, cached);
+		free(cached);
+		cache_stats.invalidations++;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+void usb_cache_get_stats(struct usb_cache_stats *stats)
+{
+	pthread_mutex_lock(&cache_mutex);
+	*stats = cache_stats;
+	pthread_mutex_unlock(&cache_mutex);
+}
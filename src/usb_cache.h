@@ -0,0 +1,52 @@
+/*
+ * usb_cache.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef USB_CACHE_H
+#define USB_CACHE_H
+
+#include <stdint.h>
+
+// bus number plus up to 7 hub port numbers, e.g. "3-1.4.2"
+#define USB_CACHE_PORT_PATH_LEN 32
+
+struct usb_cache_entry {
+	// key
+	char port_path[USB_CACHE_PORT_PATH_LEN];
+	uint16_t vid, pid;
+	uint8_t serial_index;
+	// what the last full probe of this port found
+	uint16_t langid;	// 0 if not known yet
+	int config;
+	uint8_t interface, ep_in, ep_out;
+	int wMaxPacketSize;
+};
+
+struct usb_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t invalidations;
+};
+
+void usb_cache_init(const char *filename);
+void usb_cache_shutdown(void);
+int usb_cache_lookup(struct usb_cache_entry *entry);
+void usb_cache_store(const struct usb_cache_entry *entry);
+void usb_cache_set_langid(const struct usb_cache_entry *key, uint16_t langid);
+void usb_cache_invalidate(const struct usb_cache_entry *key);
+void usb_cache_get_stats(struct usb_cache_stats *stats);
+
+#endif
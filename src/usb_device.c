@@ -33,18 +33,33 @@
 
 #include "collection.h"
 #include "usb.h"
+#include "usb_bus.h"
 #include "usb_device.h"
+#include "device.h"
 #include "log.h"
 #include "utils.h"
+#include "worker.h"
 
-int usb_device_disconnect(struct usb_device *dev)
+static void libusb_transport_disconnect(struct usb_device *dev)
 {
+	// parked TX xfers are not submitted, nothing will call back for them
+	FOREACH(struct libusb_transfer *xfer, &dev->recovery.tx_stalled) {
+		usb_device_free_xfer(xfer);
+	} ENDFOREACH
+	collection_free(&dev->recovery.tx_stalled);
+	collection_init(&dev->recovery.tx_stalled);
+
 	if(!dev->dev) {
-		return -1;
+		return;
+	}
+
+	// kill the probe, rx and tx xfers; the device is only freed once
+	// every callback has been delivered (see usb_device_disconnect_finished)
+	if(dev->probe_xfer) {
+		usbmuxd_log(LL_DEBUG, "usb_device_disconnect: cancelling probe xfer %p", dev->probe_xfer);
+		libusb_cancel_transfer(dev->probe_xfer);
 	}
 
-	// kill the rx xfer and tx xfers and try to make sure the callbacks
-	// get called before we free the device
 	FOREACH(struct libusb_transfer *xfer, &dev->rx_xfers) {
 		usbmuxd_log(LL_DEBUG, "usb_device_disconnect: cancelling RX xfer %p", xfer);
 		libusb_cancel_transfer(xfer);
@@ -54,34 +69,326 @@ int usb_device_disconnect(struct usb_device *dev)
 		usbmuxd_log(LL_DEBUG, "usb_device_disconnect: cancelling TX xfer %p", xfer);
 		libusb_cancel_transfer(xfer);
 	} ENDFOREACH
+}
+
+static int libusb_transport_disconnect_finished(struct usb_device *dev)
+{
+	if(dev->probe_xfer || collection_count(&dev->rx_xfers) || collection_count(&dev->tx_xfers)) {
+		return 0;
+	}
+	// a worker may still be clearing a halt through the handle
+	if(dev->recovery.pending & (USB_RECOVER_RX | USB_RECOVER_TX)) {
+		return 0;
+	}
+	if(dev->dev) {
+		libusb_release_interface(dev->dev, dev->interface);
+		libusb_close(dev->dev);
+		dev->dev = NULL;
+	}
+	return 1;
+}
+
+int usb_device_disconnect(struct usb_device *dev)
+{
+	if(dev->state == USBDEV_DISCONNECTING) {
+		return 0;
+	}
+	dev->state = USBDEV_DISCONNECTING;
+	if(dev->transport->disconnect) {
+		dev->transport->disconnect(dev);
+	}
+	return 0;
+}
+
+int usb_device_disconnect_finished(struct usb_device *dev)
+{
+	if(dev->state != USBDEV_DISCONNECTING) {
+		return 0;
+	}
+	if(dev->transport->disconnect_finished) {
+		return dev->transport->disconnect_finished(dev);
+	}
+	return 1;
+}
+
+/*
+ * Every bulk transfer gets one of these as user_data, so the completion
+ * can be accounted against the time it was submitted at.
+ */
+struct usb_xfer_ctx {
+	struct usb_device *dev;
+	uint64_t submit_time;
+	uint64_t seq;	// TX submission order, to replay stalled xfers in order
+};
+
+static int stats_bucket(uint64_t val)
+{
+	int bucket = 0;
+	while(val && bucket < USB_STATS_BUCKETS - 1) {
+		val >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+struct libusb_transfer *usb_device_alloc_xfer(struct usb_device *dev)
+{
+	struct libusb_transfer *xfer = libusb_alloc_transfer(0);
+	if(!xfer)
+		return NULL;
+	struct usb_xfer_ctx *ctx = malloc(sizeof(struct usb_xfer_ctx));
+	if(!ctx) {
+		libusb_free_transfer(xfer);
+		return NULL;
+	}
+	ctx->dev = dev;
+	ctx->submit_time = 0;
+	ctx->seq = 0;
+	xfer->user_data = ctx;
+	return xfer;
+}
 
-	// Busy-wait until all xfers are closed
-	while(collection_count(&dev->rx_xfers) || collection_count(&dev->tx_xfers)) {
-		struct timeval tv;
-		int res;
+// Free a transfer from usb_device_alloc_xfer() along with its buffer
+void usb_device_free_xfer(struct libusb_transfer *xfer)
+{
+	free(xfer->user_data);
+	free(xfer->buffer);
+	libusb_free_transfer(xfer);
+}
+
+struct usb_device *usb_device_xfer_get_device(struct libusb_transfer *xfer)
+{
+	return ((struct usb_xfer_ctx *)xfer->user_data)->dev;
+}
+
+/**
+ * Submit a bulk transfer and account it in stats.
+ *
+ * @param in_flight Number of transfers of the same direction that are
+ *     already submitted.
+ */
+int usb_device_submit_xfer(struct libusb_transfer *xfer, struct usb_xfer_stats *stats, int in_flight)
+{
+	struct usb_xfer_ctx *ctx = xfer->user_data;
+	int res;
+
+	ctx->submit_time = ustime64();
+	res = libusb_submit_transfer(xfer);
+	if(res == 0) {
+		usb_xfer_stats_submitted(stats, in_flight);
+	}
+	return res;
+}
+
+// Account a completed bulk transfer, called first thing in its callback
+void usb_device_account_xfer(struct libusb_transfer *xfer, struct usb_xfer_stats *stats)
+{
+	struct usb_xfer_ctx *ctx = xfer->user_data;
+
+	usb_xfer_stats_completed(stats, xfer->status, xfer->actual_length, ctx->submit_time);
+}
+
+void usb_xfer_stats_submitted(struct usb_xfer_stats *stats, int in_flight)
+{
+	stats->depth[stats_bucket(in_flight + 1)]++;
+}
+
+void usb_xfer_stats_completed(struct usb_xfer_stats *stats, int status, int length, uint64_t submit_time)
+{
+	stats->transfers++;
+	if(status >= 0 && status < USB_STATS_NUM_STATUS)
+		stats->status[status]++;
+	if(status == LIBUSB_TRANSFER_COMPLETED) {
+		stats->bytes += length;
+		stats->size[stats_bucket(length)]++;
+		stats->latency[stats_bucket(ustime64() - submit_time)]++;
+	}
+}
+
+static int recover_start(struct usb_device *dev, int what, worker_job_cb job, worker_done_cb done)
+{
+	if(++dev->recovery.failures > USB_MAX_RECOVERIES) {
+		usbmuxd_log(LL_ERROR, "Device %d-%d keeps stalling, giving up after %d recoveries", dev->bus, dev->address, USB_MAX_RECOVERIES);
+		return -1;
+	}
+	if(worker_queue(job, done, dev) < 0) {
+		usbmuxd_log(LL_ERROR, "Could not queue halt recovery for device %d-%d", dev->bus, dev->address);
+		return -1;
+	}
+	dev->recovery.pending |= what;
+	return 0;
+}
+
+static void recover_rx_job(void *data)
+{
+	struct usb_device *dev = data;
+	dev->recovery.rx_result = libusb_clear_halt(dev->dev, dev->ep_in);
+}
 
-		tv.tv_sec = 0;
-		tv.tv_usec = 1000;
-		if((res = libusb_handle_events_timeout(NULL, &tv)) < 0) {
-			usbmuxd_log(LL_ERROR, "libusb_handle_events_timeout for usb_device_disconnect failed: %s", libusb_error_name(res));
+static void recover_rx_done(void *data)
+{
+	struct usb_device *dev = data;
+	int restart = dev->recovery.rx_restart;
+
+	dev->recovery.pending &= ~USB_RECOVER_RX;
+	dev->recovery.rx_restart = 0;
+	if(dev->state == USBDEV_DISCONNECTING)
+		return;
+	if(dev->recovery.rx_result != 0) {
+		usbmuxd_log(LL_ERROR, "Could not clear RX halt on device %d-%d: %s", dev->bus, dev->address, libusb_error_name(dev->recovery.rx_result));
+		dev->alive = 0;
+		return;
+	}
+	dev->rx_stats.recoveries++;
+	usbmuxd_log(LL_NOTICE, "Cleared RX halt on device %d-%d, restarting %d RX loops", dev->bus, dev->address, restart);
+	while(restart-- > 0) {
+		if(usb_device_start_rx_loop(dev, dev->rx_callback) < 0)
 			break;
+	}
+	if(collection_count(&dev->rx_xfers) == 0)
+		dev->alive = 0;
+}
+
+/**
+ * Called by the RX callback for a failed xfer. A stall or timeout that
+ * did not transfer any data loses nothing, so the xfer is dropped and
+ * restarted once the halt on ep_in has been cleared.
+ *
+ * @return 0 if the xfer has been freed and recovery is under way, -1 if
+ *     the device should be removed
+ */
+int usb_device_recover_rx(struct usb_device *dev, struct libusb_transfer *xfer)
+{
+	if(xfer->status != LIBUSB_TRANSFER_STALL && xfer->status != LIBUSB_TRANSFER_TIMED_OUT)
+		return -1;
+	if(xfer->actual_length > 0)
+		return -1;
+	if(!(dev->recovery.pending & USB_RECOVER_RX)) {
+		if(recover_start(dev, USB_RECOVER_RX, recover_rx_job, recover_rx_done) < 0)
+			return -1;
+		usbmuxd_log(LL_NOTICE, "RX endpoint of device %d-%d stalled, clearing halt", dev->bus, dev->address);
+	}
+	collection_remove(&dev->rx_xfers, xfer);
+	usb_device_free_xfer(xfer);
+	dev->recovery.rx_restart++;
+	return 0;
+}
+
+static int xfer_seq_cmp(const void *a, const void *b)
+{
+	const struct usb_xfer_ctx *ca = (*(struct libusb_transfer * const *)a)->user_data;
+	const struct usb_xfer_ctx *cb = (*(struct libusb_transfer * const *)b)->user_data;
+	return (ca->seq > cb->seq) - (ca->seq < cb->seq);
+}
+
+// Resubmit the parked TX xfers in the order they were sent in
+static void tx_replay(struct usb_device *dev)
+{
+	int count = collection_count(&dev->recovery.tx_stalled);
+	struct libusb_transfer **xfers = malloc(sizeof(struct libusb_transfer *) * (count + 1));
+	int i = 0;
+	int res;
+
+	FOREACH(struct libusb_transfer *xfer, &dev->recovery.tx_stalled) {
+		xfers[i++] = xfer;
+	} ENDFOREACH
+	collection_free(&dev->recovery.tx_stalled);
+	collection_init(&dev->recovery.tx_stalled);
+	dev->recovery.pending &= ~USB_RECOVER_TX_REPLAY;
+
+	qsort(xfers, count, sizeof(struct libusb_transfer *), xfer_seq_cmp);
+	usbmuxd_log(LL_NOTICE, "Resubmitting %d TX transfers to device %d-%d", count, dev->bus, dev->address);
+	for(i = 0; i < count; i++) {
+		if(dev->alive) {
+			res = usb_device_submit_xfer(xfers[i], &dev->tx_stats, collection_count(&dev->tx_xfers));
+			if(res == 0) {
+				collection_add(&dev->tx_xfers, xfers[i]);
+				continue;
+			}
+			usbmuxd_log(LL_ERROR, "Failed to resubmit TX transfer to device %d-%d: %s", dev->bus, dev->address, libusb_error_name(res));
+			dev->alive = 0;
 		}
+		int length = xfers[i]->length;
+		usb_device_free_xfer(xfers[i]);
+		usb_device_tx_done(dev, length);
+	}
+	free(xfers);
+}
+
+static void recover_tx_job(void *data)
+{
+	struct usb_device *dev = data;
+	dev->recovery.tx_result = libusb_clear_halt(dev->dev, dev->ep_out);
+}
+
+static void recover_tx_done(void *data)
+{
+	struct usb_device *dev = data;
+
+	dev->recovery.pending &= ~USB_RECOVER_TX;
+	if(dev->state == USBDEV_DISCONNECTING)
+		return;
+	if(dev->recovery.tx_result != 0) {
+		usbmuxd_log(LL_ERROR, "Could not clear TX halt on device %d-%d: %s", dev->bus, dev->address, libusb_error_name(dev->recovery.tx_result));
+		dev->alive = 0;
+		return;
 	}
+	dev->tx_stats.recoveries++;
+	usbmuxd_log(LL_NOTICE, "Cleared TX halt on device %d-%d", dev->bus, dev->address);
+	// the xfers cancelled behind the stalled one have to be back first
+	dev->recovery.pending |= USB_RECOVER_TX_REPLAY;
+	if(collection_count(&dev->tx_xfers) == 0)
+		tx_replay(dev);
+}
+
+/**
+ * Park a failed TX xfer for resubmission. Only xfers that did not
+ * transfer any data can be resubmitted without corrupting the stream.
+ *
+ * @return 0 if the xfer has been parked, -1 if the device should be removed
+ */
+static int tx_recover(struct usb_device *dev, struct libusb_transfer *xfer)
+{
+	int recovering = dev->recovery.pending & (USB_RECOVER_TX | USB_RECOVER_TX_REPLAY);
 
-	collection_free(&dev->tx_xfers);
-	collection_free(&dev->rx_xfers);
-	libusb_release_interface(dev->dev, dev->interface);
-	libusb_close(dev->dev);
-	dev->dev = NULL;
+	if(dev->state == USBDEV_DISCONNECTING || xfer->actual_length > 0)
+		return -1;
+	if(xfer->status == LIBUSB_TRANSFER_CANCELLED) {
+		// cancelled by us below, unless the device is going away
+		if(!recovering)
+			return -1;
+	} else if(xfer->status == LIBUSB_TRANSFER_STALL || xfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+		if(!recovering) {
+			if(recover_start(dev, USB_RECOVER_TX, recover_tx_job, recover_tx_done) < 0)
+				return -1;
+			usbmuxd_log(LL_NOTICE, "TX endpoint of device %d-%d stalled, clearing halt", dev->bus, dev->address);
+			// xfers queued behind this one must not overtake it
+			FOREACH(struct libusb_transfer *other, &dev->tx_xfers) {
+				if(other != xfer)
+					libusb_cancel_transfer(other);
+			} ENDFOREACH
+		}
+	} else {
+		return -1;
+	}
+	collection_remove(&dev->tx_xfers, xfer);
+	collection_add(&dev->recovery.tx_stalled, xfer);
+	if((dev->recovery.pending & USB_RECOVER_TX_REPLAY) && collection_count(&dev->tx_xfers) == 0)
+		tx_replay(dev);
 	return 0;
 }
 
 // Callback from write operation
 static void tx_callback(struct libusb_transfer *xfer)
 {
-	struct usb_device *dev = xfer->user_data;
+	struct usb_device *dev = usb_device_xfer_get_device(xfer);
+	usb_device_account_xfer(xfer, &dev->tx_stats);
 	usbmuxd_log(LL_SPEW, "TX callback dev %d-%d len %d -> %d status %d", dev->bus, dev->address, xfer->length, xfer->actual_length, xfer->status);
-	if(xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+	if(xfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		dev->recovery.failures = 0;
+	} else if(tx_recover(dev, xfer) == 0) {
+		return;
+	} else {
 		switch(xfer->status) {
 			case LIBUSB_TRANSFER_COMPLETED: //shut up compiler
 			case LIBUSB_TRANSFER_ERROR:
@@ -109,33 +416,42 @@ static void tx_callback(struct libusb_transfer *xfer)
 				// this should never be reached.
 				break;
 		}
-		// we can't usb_device_disconnect here due to a deadlock, so instead mark it as dead and reap it after processing events
-		// we'll do device_remove there too
+		// mark it as dead and reap it after processing events,
+		// we'll do device_remove and usb_device_disconnect there
 		dev->alive = 0;
 	}
-	if(xfer->buffer)
-		free(xfer->buffer);
+	int length = xfer->length;
 	collection_remove(&dev->tx_xfers, xfer);
-	libusb_free_transfer(xfer);
+	usb_device_free_xfer(xfer);
+	usb_device_tx_done(dev, length);
 }
 
 static int send(struct usb_device *dev, void *buf, int length)
 {
-	struct libusb_transfer *xfer = libusb_alloc_transfer(0);
+	struct libusb_transfer *xfer = usb_device_alloc_xfer(dev);
 	int res;
-	libusb_fill_bulk_transfer(xfer, dev->dev, dev->ep_out, buf, length, tx_callback, dev, 0);
-	res = libusb_submit_transfer(xfer);
+	if (!xfer)
+		return LIBUSB_ERROR_NO_MEM;
+	libusb_fill_bulk_transfer(xfer, dev->dev, dev->ep_out, buf, length, tx_callback, xfer->user_data, 0);
+	((struct usb_xfer_ctx *)xfer->user_data)->seq = dev->recovery.tx_seq++;
+	if (dev->recovery.pending & (USB_RECOVER_TX | USB_RECOVER_TX_REPLAY)) {
+		// queue up behind the stalled xfers
+		collection_add(&dev->recovery.tx_stalled, xfer);
+		return 0;
+	}
+	res = usb_device_submit_xfer(xfer, &dev->tx_stats, collection_count(&dev->tx_xfers));
 	if (res < 0) {
-		libusb_free_transfer(xfer);
+		xfer->buffer = NULL; // owned by the caller on failure
+		usb_device_free_xfer(xfer);
 	} else {
 		collection_add(&dev->tx_xfers, xfer);
 	}
 	return res;
 }
 
-int usb_device_send(struct usb_device *dev, const unsigned char *buf, int length)
+static int libusb_transport_send(struct usb_device *dev, unsigned char *buf, int length)
 {
-	int res = send(dev, (void*) buf, length);
+	int res = send(dev, buf, length);
 	if (res < 0) {
 		usbmuxd_log(LL_ERROR, "Failed to submit TX transfer %p len %d to device %d-%d: %s", buf, length, dev->bus, dev->address, libusb_error_name(res));
 		return res;
@@ -146,24 +462,154 @@ int usb_device_send(struct usb_device *dev, const unsigned char *buf, int length
 		void *buffer = malloc(1);
 		res = send(dev, buffer, 0);
 		if (res < 0) {
+			// the data transfer is out and owns buf, so this cannot fail
+			// the send; the packet is incomplete though, give up on the device
+			free(buffer);
 			usbmuxd_log(LL_ERROR, "Failed to submit TX ZLP transfer to device %d-%d: %s", dev->bus, dev->address, libusb_error_name(res));
-			return res;
+			dev->alive = 0;
 		}
 	}
 	return 0;
 }
 
+const struct usb_transport usb_libusb_transport = {
+	"libusb",
+	libusb_transport_send,
+	libusb_transport_disconnect,
+	libusb_transport_disconnect_finished,
+	1
+};
+
+struct usb_tx_packet {
+	unsigned char *buf;
+	int length;
+	struct usb_tx_packet *next;
+};
+
+static int tx_submit(struct usb_device *dev, unsigned char *buf, int length)
+{
+	int res;
+	dev->tx_stats.in_flight_bytes += length;
+	res = dev->transport->send(dev, buf, length);
+	if(res < 0)
+		dev->tx_stats.in_flight_bytes -= length;
+	return res;
+}
+
+/**
+ * Send a mux packet. At most USB_TX_MAX_IN_FLIGHT bytes, less when other
+ * devices on the same bus are busy (see usb_bus_tx_limit()), are handed
+ * to the transport at a time, everything beyond that is queued in order and
+ * submitted as transfers complete. Once the queue exceeds
+ * USB_TX_QUEUE_HIGH, the mux layer is told to stop reading from the
+ * clients of this device, see device_tx_pressure_changed().
+ *
+ * On success the buffer is owned by the USB layer.
+ */
+int usb_device_send(struct usb_device *dev, unsigned char *buf, int length)
+{
+	struct usb_xfer_stats *stats = &dev->tx_stats;
+
+	// a packet larger than the limit still has to go out on its own
+	if(dev->tx_queue_head || (stats->in_flight_bytes > 0 && stats->in_flight_bytes + length > usb_bus_tx_limit(dev))) {
+		struct usb_tx_packet *pkt = malloc(sizeof(struct usb_tx_packet));
+		if(!pkt)
+			return -1;
+		pkt->buf = buf;
+		pkt->length = length;
+		pkt->next = NULL;
+		if(dev->tx_queue_tail)
+			dev->tx_queue_tail->next = pkt;
+		else
+			dev->tx_queue_head = pkt;
+		dev->tx_queue_tail = pkt;
+		stats->queued_bytes += length;
+		if(stats->queued_bytes > stats->queued_peak)
+			stats->queued_peak = stats->queued_bytes;
+		if(!dev->tx_congested && stats->queued_bytes >= USB_TX_QUEUE_HIGH) {
+			usbmuxd_log(LL_DEBUG, "TX queue of device %d-%d is full, throttling clients", dev->bus, dev->address);
+			dev->tx_congested = 1;
+			stats->throttled++;
+			device_tx_pressure_changed(dev);
+		}
+		return 0;
+	}
+	return tx_submit(dev, buf, length);
+}
+
+void usb_device_tx_done(struct usb_device *dev, int length)
+{
+	struct usb_xfer_stats *stats = &dev->tx_stats;
+	struct usb_tx_packet *pkt;
+
+	stats->in_flight_bytes -= length;
+	while((pkt = dev->tx_queue_head) && dev->state == USBDEV_ACTIVE && dev->alive) {
+		if(stats->in_flight_bytes > 0 && stats->in_flight_bytes + pkt->length > usb_bus_tx_limit(dev))
+			break;
+		dev->tx_queue_head = pkt->next;
+		if(!dev->tx_queue_head)
+			dev->tx_queue_tail = NULL;
+		stats->queued_bytes -= pkt->length;
+		if(tx_submit(dev, pkt->buf, pkt->length) < 0) {
+			// the mux stream has a hole now, there is no way to go on
+			usbmuxd_log(LL_ERROR, "Could not submit queued packet to device %d-%d", dev->bus, dev->address);
+			free(pkt->buf);
+			dev->alive = 0;
+		}
+		free(pkt);
+	}
+	if(dev->tx_congested && stats->queued_bytes <= USB_TX_QUEUE_LOW) {
+		usbmuxd_log(LL_DEBUG, "TX queue of device %d-%d has drained, resuming clients", dev->bus, dev->address);
+		dev->tx_congested = 0;
+		device_tx_pressure_changed(dev);
+	}
+	if(!dev->tx_queue_head && dev->state == USBDEV_ACTIVE && dev->alive)
+		device_tx_ready(dev);
+}
+
+void usb_device_tx_queue_free(struct usb_device *dev)
+{
+	struct usb_tx_packet *pkt;
+	while((pkt = dev->tx_queue_head)) {
+		dev->tx_queue_head = pkt->next;
+		free(pkt->buf);
+		free(pkt);
+	}
+	dev->tx_queue_tail = NULL;
+	dev->tx_stats.queued_bytes = 0;
+}
+
+int usb_device_tx_congested(struct usb_device *dev)
+{
+	return dev->tx_congested;
+}
+
+/**
+ * Check whether a packet of length bytes would be handed to the transport
+ * right away instead of being queued.
+ */
+int usb_device_tx_room(struct usb_device *dev, int length)
+{
+	struct usb_xfer_stats *stats = &dev->tx_stats;
+	if(dev->tx_queue_head || dev->state != USBDEV_ACTIVE || !dev->alive)
+		return 0;
+	return stats->in_flight_bytes == 0 || stats->in_flight_bytes + length <= usb_bus_tx_limit(dev);
+}
+
 // Start a read-callback loop for this device
 int usb_device_start_rx_loop(struct usb_device *dev, libusb_transfer_cb_fn callback)
 {
 	int res;
 	void *buf;
-	struct libusb_transfer *xfer = libusb_alloc_transfer(0);
+	struct libusb_transfer *xfer = usb_device_alloc_xfer(dev);
+	if(!xfer)
+		return LIBUSB_ERROR_NO_MEM;
+	dev->rx_callback = callback;
 	buf = malloc(USB_MRU);
-	libusb_fill_bulk_transfer(xfer, dev->dev, dev->ep_in, buf, USB_MRU, callback, dev, 0);
-	if((res = libusb_submit_transfer(xfer)) != 0) {
+	libusb_fill_bulk_transfer(xfer, dev->dev, dev->ep_in, buf, USB_MRU, callback, xfer->user_data, 0);
+	if((res = usb_device_submit_xfer(xfer, &dev->rx_stats, collection_count(&dev->rx_xfers))) != 0) {
 		usbmuxd_log(LL_ERROR, "Failed to submit RX transfer to device %d-%d: %s", dev->bus, dev->address, libusb_error_name(res));
-		libusb_free_transfer(xfer);
+		usb_device_free_xfer(xfer);
 		return res;
 	}
 
@@ -174,7 +620,7 @@ int usb_device_start_rx_loop(struct usb_device *dev, libusb_transfer_cb_fn callb
 
 const char *usb_device_get_serial(struct usb_device *dev)
 {
-	if(!dev->dev) {
+	if(dev->state != USBDEV_ACTIVE) {
 		return NULL;
 	}
 	return dev->serial;
@@ -182,7 +628,7 @@ const char *usb_device_get_serial(struct usb_device *dev)
 
 uint32_t usb_device_get_location(struct usb_device *dev)
 {
-	if(!dev->dev) {
+	if(dev->state != USBDEV_ACTIVE) {
 		return 0;
 	}
 	return (dev->bus << 16) | dev->address;
@@ -190,7 +636,7 @@ uint32_t usb_device_get_location(struct usb_device *dev)
 
 uint16_t usb_device_get_pid(struct usb_device *dev)
 {
-	if(!dev->dev) {
+	if(dev->state != USBDEV_ACTIVE) {
 		return 0;
 	}
 	return dev->devdesc.idProduct;
@@ -198,7 +644,7 @@ uint16_t usb_device_get_pid(struct usb_device *dev)
 
 uint64_t usb_device_get_speed(struct usb_device *dev)
 {
-	if (!dev->dev) {
+	if (dev->state != USBDEV_ACTIVE) {
 		return 0;
 	}
 	return dev->speed;
@@ -24,31 +24,152 @@
 
 #include <libusb.h>
 #include "collection.h"
+#include "usb_cache.h"
 
 // libusb fragments packets larger than this (usbfs limitation)
 // on input, this creates race conditions and other issues
 #define USB_MRU 16384
 
+// log2 histogram buckets: bucket 0 counts zero, bucket n counts values
+// in [2^(n-1), 2^n), the last bucket also counts everything above
+#define USB_STATS_BUCKETS 32
+#define USB_STATS_NUM_STATUS (LIBUSB_TRANSFER_OVERFLOW + 1)
+
+struct usb_xfer_stats {
+	uint64_t transfers;	// completed callbacks, whatever their status
+	uint64_t bytes;	// actual_length of successful transfers
+	uint64_t status[USB_STATS_NUM_STATUS];	// callbacks by libusb_transfer_status
+	uint64_t latency[USB_STATS_BUCKETS];	// microseconds from submit to completion
+	uint64_t size[USB_STATS_BUCKETS];	// actual_length of successful transfers
+	uint64_t depth[USB_STATS_BUCKETS];	// transfers in flight, sampled at submit
+	uint64_t recoveries;	// endpoint halts cleared without dropping the device
+	// TX only, see usb_device_send()
+	uint64_t in_flight_bytes;	// handed to the transport, not completed yet
+	uint64_t queued_bytes;	// waiting for in-flight bytes to drain
+	uint64_t queued_peak;
+	uint64_t throttled;	// times clients were stopped to let the queue drain
+};
+
+// Mux packets beyond this many bytes in flight are queued
+#define USB_TX_MAX_IN_FLIGHT (256 * 1024)
+// Clients of a device are not read from while this much is queued...
+#define USB_TX_QUEUE_HIGH (512 * 1024)
+// ...until it has drained to this
+#define USB_TX_QUEUE_LOW (128 * 1024)
+
+struct usb_tx_packet;
+struct usb_bus;
+
+// halts cleared in a row, without a transfer completing in between,
+// before a device is given up on and removed
+#define USB_MAX_RECOVERIES 3
+
+#define USB_RECOVER_RX		1	// clearing the halt of ep_in
+#define USB_RECOVER_TX		2	// clearing the halt of ep_out
+#define USB_RECOVER_TX_REPLAY	4	// ep_out cleared, waiting for cancelled TX xfers
+
+/*
+ * A stalled bulk endpoint is cleared on a worker thread while the device
+ * stays attached. RX xfers that failed are simply restarted afterwards.
+ * TX xfers carry mux packets that the device has not seen yet, so they
+ * are parked, together with everything sent in the meantime, and then
+ * resubmitted in their original order. This keeps the mux sequence
+ * numbers and the TCP state of all connections intact.
+ */
+struct usb_recovery {
+	int pending;	// USB_RECOVER_* bits
+	int rx_result, tx_result;	// of libusb_clear_halt(), set by the worker
+	int failures;	// recoveries since the last completed transfer
+	int rx_restart;	// RX loops to restart once ep_in is cleared
+	struct collection tx_stalled;	// TX xfers to resubmit once ep_out is cleared
+	uint64_t tx_seq;	// TX submission order, see usb_xfer_ctx
+};
+
+enum usb_device_state {
+	USBDEV_CONFIGURING,	// opened and configured by a worker thread
+	USBDEV_PROBING,		// reading the serial number string descriptor
+	USBDEV_ACTIVE,		// handed over to the mux layer
+	USBDEV_DISCONNECTING	// waiting for cancelled transfers to call back
+};
+
+struct usb_device;
+
+/*
+ * The mux layer (device.c) talks to a device only through its transport.
+ * Besides the libusb backend there is a raw usbfs one on Linux
+ * (usb_usbfs.c) and a simulated one (usb_sim.c).
+ */
+struct usb_transport {
+	const char *name;
+	// queue a mux packet; on success the transport takes ownership of buf
+	int (*send)(struct usb_device *dev, unsigned char *buf, int length);
+	// cancel everything in flight, see usb_device_disconnect()
+	void (*disconnect)(struct usb_device *dev);
+	// release the device once nothing is in flight anymore; 1 when done
+	int (*disconnect_finished)(struct usb_device *dev);
+	// whether new devices go through the lockdownd preflight
+	int preflight;
+};
+
+extern const struct usb_transport usb_libusb_transport;
+
 struct usb_device {
-	libusb_device_handle *dev;
+	const struct usb_transport *transport;
+	libusb_device_handle *dev;	// NULL once handed over to usbfs
+	libusb_device *device;	// referenced while configuring
+	enum usb_device_state state;
+	int configure_result;
+	struct libusb_transfer *probe_xfer;	// langid/serial control transfer in flight
+	struct usb_cache_entry cache;	// attach cache key and what probing found
+	int langid_cached;	// serial was requested with the cached language ID
 	uint8_t bus, address;
 	char serial[256];
 	int alive;
 	uint8_t interface, ep_in, ep_out;
 	struct collection rx_xfers;
 	struct collection tx_xfers;
+	libusb_transfer_cb_fn rx_callback;
+	struct usb_recovery recovery;
+	struct usb_tx_packet *tx_queue_head, *tx_queue_tail;
+	int tx_congested;
+	struct usb_bus *bus_group;	// devices sharing the root port, see usb_bus.c
+	int bus_weight;
 	int wMaxPacketSize;
 	uint64_t speed;
 	struct libusb_device_descriptor devdesc;
+	struct usb_xfer_stats rx_stats;
+	struct usb_xfer_stats tx_stats;
+	int usbfs_fd;	// usbfs backend, -1 otherwise
+	uint32_t usbfs_caps;
 };
 
+// Cancel all transfers; returns immediately, completion is reported by
+// usb_device_disconnect_finished() once all callbacks have been delivered
 int usb_device_disconnect(struct usb_device *dev);
+int usb_device_disconnect_finished(struct usb_device *dev);
 const char *usb_device_get_serial(struct usb_device *dev);
 uint32_t usb_device_get_location(struct usb_device *dev);
 uint16_t usb_device_get_pid(struct usb_device *dev);
 uint64_t usb_device_get_speed(struct usb_device *dev);
 // Start a read-callback loop for this device
 int usb_device_start_rx_loop(struct usb_device *dev, libusb_transfer_cb_fn callback);
-int usb_device_send(struct usb_device *dev, const unsigned char *buf, int length);
+int usb_device_send(struct usb_device *dev, unsigned char *buf, int length);
+// Report the end of a transport send of length bytes, whatever the outcome
+void usb_device_tx_done(struct usb_device *dev, int length);
+void usb_device_tx_queue_free(struct usb_device *dev);
+int usb_device_tx_congested(struct usb_device *dev);
+int usb_device_tx_room(struct usb_device *dev, int length);
+// Try to recover from a failed RX xfer; 0 if it was taken care of
+int usb_device_recover_rx(struct usb_device *dev, struct libusb_transfer *xfer);
+
+// Bulk transfers carry their device and submit time as user_data
+struct libusb_transfer *usb_device_alloc_xfer(struct usb_device *dev);
+void usb_device_free_xfer(struct libusb_transfer *xfer);
+struct usb_device *usb_device_xfer_get_device(struct libusb_transfer *xfer);
+int usb_device_submit_xfer(struct libusb_transfer *xfer, struct usb_xfer_stats *stats, int in_flight);
+void usb_device_account_xfer(struct libusb_transfer *xfer, struct usb_xfer_stats *stats);
+// Transport independent accounting, in_flight as for usb_device_submit_xfer()
+void usb_xfer_stats_submitted(struct usb_xfer_stats *stats, int in_flight);
+void usb_xfer_stats_completed(struct usb_xfer_stats *stats, int status, int length, uint64_t submit_time);
 
 #endif
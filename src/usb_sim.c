@@ -0,0 +1,684 @@
+/*
+ * usb_sim.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "usb_sim.h"
+#include "usb.h"
+#include "usb_device.h"
+#include "device.h"
+#include "collection.h"
+#include "utils.h"
+#include "log.h"
+
+/*
+ * Simulated devices, for exercising and benchmarking the relay without
+ * any hardware attached. A simulated device speaks the device side of
+ * the mux protocol (version handshake and TCP) over two in-memory packet
+ * queues, one per direction. Each queue models a link with the
+ * configured bandwidth and one-way latency: a packet is delivered once
+ * everything queued before it has been "transmitted" and the latency
+ * has passed.
+ *
+ * Ports are served by one of these services, other ports refuse:
+ *   echo    sends everything back
+ *   sink    discards everything
+ *   source  sends a byte pattern as fast as the host's window allows
+ *
+ * Everything runs on the main thread: packets for the device are queued
+ * from usb_device_send(), and usb_sim_process() handles the due ones.
+ */
+
+#define SIM_PROTO_VERSION 0
+#define SIM_PROTO_SETUP 2
+#define SIM_PROTO_TCP IPPROTO_TCP
+
+#define SIM_WINDOW 131072
+#define SIM_PID 0x12a8
+#define SIM_DEFAULT_SPEED 480000000
+
+struct sim_mux_header {
+	uint32_t protocol;
+	uint32_t length;
+	uint32_t magic;
+	uint16_t tx_seq;
+	uint16_t rx_seq;
+};
+
+struct sim_version_header {
+	uint32_t major;
+	uint32_t minor;
+	uint32_t padding;
+};
+
+// keep device to host packets within a single RX transfer
+#define SIM_MAX_PAYLOAD (USB_MRU - sizeof(struct sim_mux_header) - sizeof(struct tcphdr))
+
+enum sim_service_type {
+	SIM_ECHO,
+	SIM_SINK,
+	SIM_SOURCE
+};
+
+struct sim_service {
+	uint16_t port;
+	enum sim_service_type type;
+};
+
+struct sim_packet {
+	struct sim_packet *next;
+	uint64_t queued_at;
+	uint64_t deliver_at;
+	unsigned char *buf;
+	int length;
+};
+
+struct sim_link {
+	uint64_t bandwidth;	// bits per second, 0 for unlimited
+	uint64_t latency;	// microseconds
+	uint64_t busy_until;	// when the last queued packet is transmitted
+	struct sim_packet *head;
+	struct sim_packet *tail;
+	int count;
+};
+
+struct sim_connection {
+	enum sim_service_type type;
+	uint16_t port, host_port;
+	uint32_t seq;	// next sequence number we send
+	uint32_t ack;	// next sequence number expected from the host
+	uint32_t host_ack, host_win;
+	unsigned char *ob_buf;	// echo data waiting for the host's window
+	uint32_t ob_size;
+	uint32_t ob_capacity;
+};
+
+struct sim_device {
+	struct usb_device usbdev;	// must be first, see sim_transport_send()
+	int version;
+	uint16_t tx_seq, rx_seq;
+	struct sim_link to_device;
+	struct sim_link to_host;
+	struct collection services;
+	struct collection connections;
+};
+
+static struct collection sim_devices;
+static int notify_pipe[2] = { -1, -1 };
+static int notified;
+static unsigned char *source_data;
+
+static const char *service_name(enum sim_service_type type)
+{
+	switch(type) {
+		case SIM_ECHO:
+			return "echo";
+		case SIM_SINK:
+			return "sink";
+		case SIM_SOURCE:
+			return "source";
+		default:
+			return "unknown";
+	}
+}
+
+static void sim_link_queue(struct sim_link *link, unsigned char *buf, int length)
+{
+	struct sim_packet *pkt = malloc(sizeof(struct sim_packet));
+	uint64_t now = ustime64();
+	uint64_t start = (link->busy_until > now) ? link->busy_until : now;
+
+	if(link->bandwidth)
+		start += (uint64_t)length * 8 * 1000000 / link->bandwidth;
+	link->busy_until = start;
+
+	pkt->next = NULL;
+	pkt->queued_at = now;
+	pkt->deliver_at = start + link->latency;
+	pkt->buf = buf;
+	pkt->length = length;
+	if(link->tail)
+		link->tail->next = pkt;
+	else
+		link->head = pkt;
+	link->tail = pkt;
+	link->count++;
+}
+
+static struct sim_packet *sim_link_pop_due(struct sim_link *link, uint64_t now)
+{
+	struct sim_packet *pkt = link->head;
+	if(!pkt || pkt->deliver_at > now)
+		return NULL;
+	link->head = pkt->next;
+	if(!link->head)
+		link->tail = NULL;
+	link->count--;
+	return pkt;
+}
+
+static void sim_link_free(struct sim_link *link)
+{
+	struct sim_packet *pkt;
+	while((pkt = link->head)) {
+		link->head = pkt->next;
+		free(pkt->buf);
+		free(pkt);
+	}
+	link->tail = NULL;
+	link->count = 0;
+}
+
+static void sim_send_packet(struct sim_device *sdev, uint32_t proto, const void *header, int hdrlen, const void *data, int length)
+{
+	int mux_header_size = (sdev->version < 2) ? 8 : sizeof(struct sim_mux_header);
+	int total = mux_header_size + hdrlen + length;
+	unsigned char *buffer = malloc(total);
+	struct sim_mux_header *mhdr = (struct sim_mux_header *)buffer;
+
+	mhdr->protocol = htonl(proto);
+	mhdr->length = htonl(total);
+	if(sdev->version >= 2) {
+		mhdr->magic = htonl(0xfeedface);
+		mhdr->tx_seq = htons(sdev->tx_seq++);
+		mhdr->rx_seq = htons(sdev->rx_seq);
+	}
+	memcpy(buffer + mux_header_size, header, hdrlen);
+	if(data && length)
+		memcpy(buffer + mux_header_size + hdrlen, data, length);
+
+	usb_xfer_stats_submitted(&sdev->usbdev.rx_stats, sdev->to_host.count);
+	sim_link_queue(&sdev->to_host, buffer, total);
+}
+
+static void sim_send_tcp(struct sim_device *sdev, uint16_t sport, uint16_t dport, uint32_t seq, uint32_t ack, uint8_t flags, uint32_t win, const void *data, int length)
+{
+	struct tcphdr th;
+	memset(&th, 0, sizeof(th));
+	th.th_sport = htons(sport);
+	th.th_dport = htons(dport);
+	th.th_seq = htonl(seq);
+	th.th_ack = htonl(ack);
+	th.th_flags = flags;
+	th.th_off = sizeof(th) / 4;
+	th.th_win = htons(win >> 8);
+	sim_send_packet(sdev, SIM_PROTO_TCP, &th, sizeof(th), data, length);
+}
+
+static uint32_t sim_connection_window(struct sim_connection *conn)
+{
+	// echo data we couldn't send back yet takes up receive window
+	if(conn->ob_size >= SIM_WINDOW)
+		return 0;
+	return SIM_WINDOW - conn->ob_size;
+}
+
+/**
+ * Send as much as the host's window allows.
+ *
+ * @return Number of packets sent.
+ */
+static int sim_connection_pump(struct sim_device *sdev, struct sim_connection *conn)
+{
+	int sent = 0;
+
+	while(1) {
+		uint32_t in_flight = conn->seq - conn->host_ack;
+		uint32_t len;
+		const unsigned char *data;
+
+		if(in_flight >= conn->host_win)
+			break;
+		len = conn->host_win - in_flight;
+		if(len > SIM_MAX_PAYLOAD)
+			len = SIM_MAX_PAYLOAD;
+
+		if(conn->type == SIM_ECHO) {
+			if(!conn->ob_size)
+				break;
+			if(len > conn->ob_size)
+				len = conn->ob_size;
+			data = conn->ob_buf;
+		} else if(conn->type == SIM_SOURCE) {
+			data = source_data;
+		} else {
+			break;
+		}
+
+		// the data is copied into the packet, so the echo buffer can shrink first
+		if(conn->type == SIM_ECHO)
+			conn->ob_size -= len;
+		sim_send_tcp(sdev, conn->port, conn->host_port, conn->seq, conn->ack, TH_ACK, sim_connection_window(conn), data, len);
+		if(conn->type == SIM_ECHO)
+			memmove(conn->ob_buf, conn->ob_buf + len, conn->ob_size);
+		conn->seq += len;
+		sent++;
+	}
+	return sent;
+}
+
+static void sim_connection_free(struct sim_device *sdev, struct sim_connection *conn)
+{
+	collection_remove(&sdev->connections, conn);
+	free(conn->ob_buf);
+	free(conn);
+}
+
+static void sim_tcp_input(struct sim_device *sdev, struct tcphdr *th, unsigned char *payload, uint32_t payload_length)
+{
+	uint16_t port = ntohs(th->th_dport);
+	uint16_t host_port = ntohs(th->th_sport);
+	struct sim_connection *conn = NULL;
+
+	FOREACH(struct sim_connection *lconn, &sdev->connections) {
+		if(lconn->port == port && lconn->host_port == host_port) {
+			conn = lconn;
+			break;
+		}
+	} ENDFOREACH
+
+	if(!conn) {
+		struct sim_service *service = NULL;
+		if(th->th_flags & TH_RST)
+			return;
+		if(th->th_flags == TH_SYN) {
+			FOREACH(struct sim_service *lservice, &sdev->services) {
+				if(lservice->port == port) {
+					service = lservice;
+					break;
+				}
+			} ENDFOREACH
+		}
+		if(!service) {
+			usbmuxd_log(LL_DEBUG, "Simulated device %s refusing connection to port %d", sdev->usbdev.serial, port);
+			sim_send_tcp(sdev, port, host_port, 0, ntohl(th->th_seq) + 1, TH_RST | TH_ACK, 0, NULL, 0);
+			return;
+		}
+		conn = malloc(sizeof(struct sim_connection));
+		memset(conn, 0, sizeof(struct sim_connection));
+		conn->type = service->type;
+		conn->port = port;
+		conn->host_port = host_port;
+		conn->seq = 0;
+		conn->ack = ntohl(th->th_seq) + 1;
+		conn->host_ack = 0;
+		conn->host_win = ntohs(th->th_win) << 8;
+		if(conn->type == SIM_ECHO) {
+			conn->ob_capacity = SIM_WINDOW;
+			conn->ob_buf = malloc(conn->ob_capacity);
+		}
+		collection_add(&sdev->connections, conn);
+		usbmuxd_log(LL_INFO, "Simulated device %s accepted %s connection on port %d", sdev->usbdev.serial, service_name(conn->type), port);
+		sim_send_tcp(sdev, port, host_port, conn->seq, conn->ack, TH_SYN | TH_ACK, sim_connection_window(conn), NULL, 0);
+		conn->seq++;
+		return;
+	}
+
+	if(th->th_flags & TH_RST) {
+		usbmuxd_log(LL_INFO, "Simulated device %s: connection on port %d closed by host", sdev->usbdev.serial, port);
+		sim_connection_free(sdev, conn);
+		return;
+	}
+
+	conn->host_ack = ntohl(th->th_ack);
+	conn->host_win = ntohs(th->th_win) << 8;
+
+	if(payload_length) {
+		conn->ack += payload_length;
+		if(conn->type == SIM_ECHO) {
+			if(conn->ob_size + payload_length > conn->ob_capacity) {
+				// the host overran our window; grow rather than lose data
+				conn->ob_capacity = conn->ob_size + payload_length;
+				conn->ob_buf = realloc(conn->ob_buf, conn->ob_capacity);
+			}
+			memcpy(conn->ob_buf + conn->ob_size, payload, payload_length);
+			conn->ob_size += payload_length;
+		}
+	}
+
+	if(!sim_connection_pump(sdev, conn) && payload_length) {
+		sim_send_tcp(sdev, conn->port, conn->host_port, conn->seq, conn->ack, TH_ACK, sim_connection_window(conn), NULL, 0);
+	}
+}
+
+static void sim_version_input(struct sim_device *sdev, struct sim_version_header *vh)
+{
+	struct sim_version_header reply;
+	uint32_t major = ntohl(vh->major);
+
+	reply.major = htonl(2);
+	reply.minor = htonl(0);
+	reply.padding = 0;
+	// answered with the header format the host asked with
+	sim_send_packet(sdev, SIM_PROTO_VERSION, &reply, sizeof(reply), NULL, 0);
+	sdev->version = (major >= 2) ? 2 : 1;
+	sdev->tx_seq = 0;
+	sdev->rx_seq = 0xFFFF;
+}
+
+static void sim_device_input(struct sim_device *sdev, unsigned char *packet, int length)
+{
+	struct sim_mux_header *mhdr = (struct sim_mux_header *)packet;
+	int mux_header_size = (sdev->version < 2) ? 8 : sizeof(struct sim_mux_header);
+
+	if(length < mux_header_size) {
+		usbmuxd_log(LL_ERROR, "Simulated device %s got a short packet (%d)", sdev->usbdev.serial, length);
+		return;
+	}
+	if(sdev->version >= 2) {
+		sdev->rx_seq = ntohs(mhdr->tx_seq);
+	}
+
+	switch(ntohl(mhdr->protocol)) {
+		case SIM_PROTO_VERSION:
+			if(length < mux_header_size + (int)sizeof(struct sim_version_header))
+				return;
+			sim_version_input(sdev, (struct sim_version_header *)(packet + mux_header_size));
+			break;
+		case SIM_PROTO_SETUP:
+			break;
+		case SIM_PROTO_TCP:
+			if(length < mux_header_size + (int)sizeof(struct tcphdr))
+				return;
+			sim_tcp_input(sdev, (struct tcphdr *)(packet + mux_header_size),
+				packet + mux_header_size + sizeof(struct tcphdr),
+				length - mux_header_size - sizeof(struct tcphdr));
+			break;
+		default:
+			usbmuxd_log(LL_WARNING, "Simulated device %s got a packet with unknown protocol %d", sdev->usbdev.serial, ntohl(mhdr->protocol));
+			break;
+	}
+}
+
+static int sim_transport_send(struct usb_device *dev, unsigned char *buf, int length)
+{
+	struct sim_device *sdev = (struct sim_device *)dev;
+
+	usb_xfer_stats_submitted(&dev->tx_stats, sdev->to_device.count);
+	sim_link_queue(&sdev->to_device, buf, length);
+	return 0;
+}
+
+static const struct usb_transport sim_transport = {
+	"simulated",
+	sim_transport_send,
+	NULL,
+	NULL,
+	0
+};
+
+static int parse_port(const char *val, uint16_t *port)
+{
+	char *end = NULL;
+	unsigned long p = strtoul(val, &end, 10);
+	if(!*val || *end || p == 0 || p > 65535)
+		return -1;
+	*port = (uint16_t)p;
+	return 0;
+}
+
+static int parse_uint64(const char *val, uint64_t *out)
+{
+	char *end = NULL;
+	unsigned long long v = strtoull(val, &end, 10);
+	if(!*val || *end)
+		return -1;
+	*out = v;
+	return 0;
+}
+
+/**
+ * Add a simulated device described by a comma separated list of
+ * key=value pairs:
+ *   serial=UDID         serial number (default SIMULATED<n>)
+ *   bandwidth=BITS      link bandwidth in bits per second (default unlimited)
+ *   latency=USEC        one-way link latency in microseconds (default 0)
+ *   echo|sink|source=PORT  run this service on PORT, can be repeated
+ *
+ * @return 0 on success, -1 if the description is invalid
+ */
+int usb_sim_add_spec(const char *spec)
+{
+	struct sim_device *sdev;
+	char *copy, *tok, *saveptr = NULL;
+	uint64_t bandwidth = 0, latency = 0;
+
+	if(!sim_devices.list)
+		collection_init(&sim_devices);
+
+	sdev = malloc(sizeof(struct sim_device));
+	memset(sdev, 0, sizeof(struct sim_device));
+	collection_init(&sdev->services);
+	collection_init(&sdev->connections);
+	snprintf(sdev->usbdev.serial, sizeof(sdev->usbdev.serial), "SIMULATED%d", collection_count(&sim_devices));
+
+	copy = strdup(spec);
+	for(tok = strtok_r(copy, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		char *val = strchr(tok, '=');
+		if(!val)
+			goto invalid;
+		*val++ = '\0';
+		if(!strcmp(tok, "serial")) {
+			if(!*val)
+				goto invalid;
+			snprintf(sdev->usbdev.serial, sizeof(sdev->usbdev.serial), "%s", val);
+		} else if(!strcmp(tok, "bandwidth")) {
+			if(parse_uint64(val, &bandwidth) < 0)
+				goto invalid;
+		} else if(!strcmp(tok, "latency")) {
+			if(parse_uint64(val, &latency) < 0)
+				goto invalid;
+		} else if(!strcmp(tok, "echo") || !strcmp(tok, "sink") || !strcmp(tok, "source")) {
+			struct sim_service *service = malloc(sizeof(struct sim_service));
+			if(parse_port(val, &service->port) < 0) {
+				free(service);
+				goto invalid;
+			}
+			service->type = (tok[0] == 'e') ? SIM_ECHO : ((tok[1] == 'i') ? SIM_SINK : SIM_SOURCE);
+			collection_add(&sdev->services, service);
+		} else {
+			goto invalid;
+		}
+	}
+	free(copy);
+
+	sdev->to_device.bandwidth = sdev->to_host.bandwidth = bandwidth;
+	sdev->to_device.latency = sdev->to_host.latency = latency;
+	sdev->usbdev.transport = &sim_transport;
+	sdev->usbdev.state = USBDEV_ACTIVE;
+	sdev->usbdev.alive = 1;
+	sdev->usbdev.usbfs_fd = -1;
+	sdev->usbdev.bus = 0;
+	sdev->usbdev.address = (uint8_t)(collection_count(&sim_devices) + 1);
+	sdev->usbdev.devdesc.idVendor = VID_APPLE;
+	sdev->usbdev.devdesc.idProduct = SIM_PID;
+	sdev->usbdev.speed = bandwidth ? bandwidth : SIM_DEFAULT_SPEED;
+	collection_init(&sdev->usbdev.rx_xfers);
+	collection_init(&sdev->usbdev.tx_xfers);
+	collection_add(&sim_devices, sdev);
+	return 0;
+
+invalid:
+	usbmuxd_log(LL_FATAL, "Invalid simulated device '%s' (at '%s')", spec, tok);
+	free(copy);
+	FOREACH(struct sim_service *service, &sdev->services) {
+		free(service);
+	} ENDFOREACH
+	collection_free(&sdev->services);
+	collection_free(&sdev->connections);
+	free(sdev);
+	return -1;
+}
+
+/**
+ * Attach all simulated devices given with usb_sim_add_spec().
+ *
+ * @return Number of simulated devices.
+ */
+int usb_sim_init(void)
+{
+	uint32_t i;
+
+	if(!sim_devices.list)
+		collection_init(&sim_devices);
+	if(collection_count(&sim_devices) == 0)
+		return 0;
+
+	if(pipe(notify_pipe) < 0) {
+		usbmuxd_log(LL_ERROR, "Could not create notification pipe for simulated devices");
+		return 0;
+	}
+	fcntl(notify_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(notify_pipe[1], F_SETFL, O_NONBLOCK);
+	notified = 0;
+
+	source_data = malloc(SIM_MAX_PAYLOAD);
+	for(i = 0; i < SIM_MAX_PAYLOAD; i++)
+		source_data[i] = (unsigned char)i;
+
+	FOREACH(struct sim_device *sdev, &sim_devices) {
+		usbmuxd_log(LL_NOTICE, "Adding simulated device %s (bandwidth %llu bit/s, latency %llu us)", sdev->usbdev.serial,
+			(unsigned long long)sdev->to_host.bandwidth, (unsigned long long)sdev->to_host.latency);
+		FOREACH(struct sim_service *service, &sdev->services) {
+			usbmuxd_log(LL_INFO, "Simulated device %s: %s service on port %d", sdev->usbdev.serial, service_name(service->type), service->port);
+		} ENDFOREACH
+		if(device_add(&sdev->usbdev) < 0) {
+			usbmuxd_log(LL_ERROR, "Could not add simulated device %s", sdev->usbdev.serial);
+		}
+	} ENDFOREACH
+	return collection_count(&sim_devices);
+}
+
+void usb_sim_shutdown(void)
+{
+	if(!sim_devices.list)
+		return;
+	FOREACH(struct sim_device *sdev, &sim_devices) {
+		device_remove(&sdev->usbdev);
+		sim_link_free(&sdev->to_device);
+		sim_link_free(&sdev->to_host);
+		FOREACH(struct sim_connection *conn, &sdev->connections) {
+			sim_connection_free(sdev, conn);
+		} ENDFOREACH
+		FOREACH(struct sim_service *service, &sdev->services) {
+			free(service);
+		} ENDFOREACH
+		collection_free(&sdev->services);
+		collection_free(&sdev->connections);
+		collection_free(&sdev->usbdev.rx_xfers);
+		collection_free(&sdev->usbdev.tx_xfers);
+		usb_device_tx_queue_free(&sdev->usbdev);
+		free(sdev);
+	} ENDFOREACH
+	collection_free(&sim_devices);
+	free(source_data);
+	source_data = NULL;
+	if(notify_pipe[0] >= 0) {
+		close(notify_pipe[0]);
+		close(notify_pipe[1]);
+		notify_pipe[0] = notify_pipe[1] = -1;
+	}
+}
+
+static uint64_t sim_next_delivery(void)
+{
+	uint64_t next = (uint64_t)-1LL;
+	FOREACH(struct sim_device *sdev, &sim_devices) {
+		if(sdev->to_device.head && sdev->to_device.head->deliver_at < next)
+			next = sdev->to_device.head->deliver_at;
+		if(sdev->to_host.head && sdev->to_host.head->deliver_at < next)
+			next = sdev->to_host.head->deliver_at;
+	} ENDFOREACH
+	return next;
+}
+
+/**
+ * Add the notification pipe to the poll set. If a packet is due already,
+ * it is made readable so the main loop calls usb_process() even if
+ * clients keep poll from ever timing out.
+ */
+void usb_sim_add_pollfds(struct fdlist *list)
+{
+	if(notify_pipe[0] < 0)
+		return;
+	if(!notified && sim_next_delivery() <= ustime64()) {
+		char c = 0;
+		if(write(notify_pipe[1], &c, 1) == 1)
+			notified = 1;
+	}
+	fdlist_add_usb_fd(list, notify_pipe[0], POLLIN);
+}
+
+int usb_sim_get_timeout(void)
+{
+	uint64_t next, now;
+
+	if(notify_pipe[0] < 0)
+		return 100000;
+	next = sim_next_delivery();
+	if(next == (uint64_t)-1LL)
+		return 100000;
+	now = ustime64();
+	if(next <= now)
+		return 0;
+	// round up, waking up early would just spin
+	if((next - now + 999) / 1000 > 100000)
+		return 100000;
+	return (int)((next - now + 999) / 1000);
+}
+
+void usb_sim_process(void)
+{
+	struct sim_packet *pkt;
+	uint64_t now;
+	char buf[64];
+
+	if(notify_pipe[0] < 0)
+		return;
+	while(read(notify_pipe[0], buf, sizeof(buf)) > 0);
+	notified = 0;
+
+	now = ustime64();
+	FOREACH(struct sim_device *sdev, &sim_devices) {
+		while((pkt = sim_link_pop_due(&sdev->to_device, now))) {
+			usb_xfer_stats_completed(&sdev->usbdev.tx_stats, LIBUSB_TRANSFER_COMPLETED, pkt->length, pkt->queued_at);
+			sim_device_input(sdev, pkt->buf, pkt->length);
+			usb_device_tx_done(&sdev->usbdev, pkt->length);
+			free(pkt->buf);
+			free(pkt);
+		}
+		while((pkt = sim_link_pop_due(&sdev->to_host, now))) {
+			usb_xfer_stats_completed(&sdev->usbdev.rx_stats, LIBUSB_TRANSFER_COMPLETED, pkt->length, pkt->queued_at);
+			device_data_input(&sdev->usbdev, pkt->buf, pkt->length);
+			free(pkt->buf);
+			free(pkt);
+		}
+	} ENDFOREACH
+}
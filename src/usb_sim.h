@@ -0,0 +1,30 @@
+/*
+ * usb_sim.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef USB_SIM_H
+#define USB_SIM_H
+
+#include "fdlist.h"
+
+int usb_sim_add_spec(const char *spec);
+int usb_sim_init(void);
+void usb_sim_shutdown(void);
+void usb_sim_add_pollfds(struct fdlist *list);
+int usb_sim_get_timeout(void);
+void usb_sim_process(void);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * usb_udev.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_LIBUDEV
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <libudev.h>
+
+#include "usb_udev.h"
+#include "usb.h"
+#include "log.h"
+
+/*
+ * Device add and remove events from udev's netlink socket, for when libusb
+ * has no hotplug support. Unlike polling the bus, this only wakes us up
+ * when a USB device actually comes or goes, and it tells us which one.
+ * Events are taken from the "udev" source rather than the kernel one so
+ * that the device node has its final permissions by the time we open it.
+ */
+
+static struct udev *udev;
+static struct udev_monitor *monitor;
+
+int usb_udev_init(void)
+{
+	udev = udev_new();
+	if(!udev) {
+		usbmuxd_log(LL_ERROR, "udev_new failed");
+		return -1;
+	}
+	monitor = udev_monitor_new_from_netlink(udev, "udev");
+	if(!monitor) {
+		usbmuxd_log(LL_ERROR, "Could not create udev monitor");
+		usb_udev_shutdown();
+		return -1;
+	}
+	// filtered in the kernel, interfaces and other subsystems never reach us
+	if(udev_monitor_filter_add_match_subsystem_devtype(monitor, "usb", "usb_device") < 0
+		|| udev_monitor_enable_receiving(monitor) < 0) {
+		usbmuxd_log(LL_ERROR, "Could not set up udev monitor");
+		usb_udev_shutdown();
+		return -1;
+	}
+	usbmuxd_log(LL_INFO, "Listening for udev USB events");
+	return 0;
+}
+
+void usb_udev_shutdown(void)
+{
+	if(monitor) {
+		udev_monitor_unref(monitor);
+		monitor = NULL;
+	}
+	if(udev) {
+		udev_unref(udev);
+		udev = NULL;
+	}
+}
+
+int usb_udev_get_fd(void)
+{
+	if(!monitor)
+		return -1;
+	return udev_monitor_get_fd(monitor);
+}
+
+static int get_uint_property(struct udev_device *dev, const char *key, int base, unsigned int *val)
+{
+	const char *str = udev_device_get_property_value(dev, key);
+	char *end = NULL;
+	if(!str)
+		return -1;
+	*val = (unsigned int)strtoul(str, &end, base);
+	return (end == str) ? -1 : 0;
+}
+
+/**
+ * Receive the next event about an Apple device.
+ *
+ * @return 1 if action, bus and address have been filled in, 0 if there is
+ *     no further event, -1 if events have been lost and the caller
+ *     should rescan the bus
+ */
+int usb_udev_receive(enum usb_udev_action *action, uint8_t *bus, uint8_t *address)
+{
+	struct udev_device *dev;
+
+	if(!monitor)
+		return 0;
+
+	while(1) {
+		const char *act;
+		unsigned int vid = 0, pid = 0, busnum = 0, devnum = 0;
+		const char *product;
+		int relevant = 0;
+
+		errno = 0;
+		dev = udev_monitor_receive_device(monitor);
+		if(!dev) {
+			if(errno == ENOBUFS) {
+				usbmuxd_log(LL_WARNING, "udev event queue overflowed");
+				return -1;
+			}
+			return 0;
+		}
+
+		act = udev_device_get_action(dev);
+		// PRODUCT is vid/pid/bcdDevice in hex, and still there on remove
+		product = udev_device_get_property_value(dev, "PRODUCT");
+		if(act && product && sscanf(product, "%x/%x", &vid, &pid) == 2 && vid == VID_APPLE
+			&& get_uint_property(dev, "BUSNUM", 10, &busnum) == 0
+			&& get_uint_property(dev, "DEVNUM", 10, &devnum) == 0) {
+			if(!strcmp(act, "add")) {
+				*action = USB_UDEV_ADD;
+				relevant = 1;
+			} else if(!strcmp(act, "remove")) {
+				*action = USB_UDEV_REMOVE;
+				relevant = 1;
+			}
+		}
+		if(relevant)
+			usbmuxd_log(LL_DEBUG, "udev %s event for device %04x:%04x at %d-%d", act, vid, pid, busnum, devnum);
+		udev_device_unref(dev);
+		if(relevant) {
+			*bus = (uint8_t)busnum;
+			*address = (uint8_t)devnum;
+			return 1;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * usb_udev.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef USB_UDEV_H
+#define USB_UDEV_H
+
+#include <stdint.h>
+
+enum usb_udev_action {
+	USB_UDEV_ADD,
+	USB_UDEV_REMOVE
+};
+
+int usb_udev_init(void);
+void usb_udev_shutdown(void);
+int usb_udev_get_fd(void);
+int usb_udev_receive(enum usb_udev_action *action, uint8_t *bus, uint8_t *address);
+
+#endif
@@ -0,0 +1,371 @@
+/*
+ * usb_usbfs.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_LINUX_USBDEVICE_FS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+
+#include "usb_usbfs.h"
+#include "usb.h"
+#include "device.h"
+#include "collection.h"
+#include "log.h"
+#include "utils.h"
+
+/*
+ * Once a device has been probed through libusb, its mux interface can be
+ * handed over to a usbfs file descriptor of our own. Bulk URBs are then
+ * submitted with USBDEVFS_SUBMITURB and, whenever the main loop sees the
+ * descriptor become writable, every completed URB is reaped at once with
+ * USBDEVFS_REAPURBNDELAY before the RX URBs of that pass are resubmitted.
+ * This skips libusb's event handling (its locks, timerfd and per-transfer
+ * callbacks) on the data path. The kernel appends the zero length packet
+ * itself (USBDEVFS_URB_ZERO_PACKET) when it supports that.
+ */
+
+struct usbfs_urb {
+	struct usbdevfs_urb urb;	// must be first, REAPURB returns its address
+	struct usb_device *dev;
+	uint64_t submit_time;
+	int rx;
+};
+
+static int has_zero_packet(struct usb_device *dev)
+{
+	return dev->usbfs_caps & USBDEVFS_CAP_ZERO_PACKET;
+}
+
+static struct usbfs_urb *urb_alloc(struct usb_device *dev, int rx, unsigned char *buf, int length)
+{
+	struct usbfs_urb *u = malloc(sizeof(struct usbfs_urb));
+	if(!u)
+		return NULL;
+	memset(u, 0, sizeof(*u));
+	u->dev = dev;
+	u->rx = rx;
+	u->urb.type = USBDEVFS_URB_TYPE_BULK;
+	u->urb.endpoint = rx ? dev->ep_in : dev->ep_out;
+	u->urb.buffer = buf;
+	u->urb.buffer_length = length;
+	u->urb.usercontext = u;
+	return u;
+}
+
+static void urb_free(struct usbfs_urb *u)
+{
+	free(u->urb.buffer);
+	free(u);
+}
+
+static int urb_submit(struct usbfs_urb *u)
+{
+	struct usb_device *dev = u->dev;
+	struct collection *list = u->rx ? &dev->rx_xfers : &dev->tx_xfers;
+	struct usb_xfer_stats *stats = u->rx ? &dev->rx_stats : &dev->tx_stats;
+
+	u->urb.status = 0;
+	u->urb.actual_length = 0;
+	u->submit_time = ustime64();
+	if(ioctl(dev->usbfs_fd, USBDEVFS_SUBMITURB, &u->urb) < 0) {
+		return -errno;
+	}
+	usb_xfer_stats_submitted(stats, collection_count(list));
+	collection_add(list, u);
+	return 0;
+}
+
+// translate an URB status to the libusb_transfer_status the stats are kept by
+static int urb_status(int status)
+{
+	switch(status) {
+		case 0:
+			return LIBUSB_TRANSFER_COMPLETED;
+		case -ENOENT:
+		case -ECONNRESET:
+			return LIBUSB_TRANSFER_CANCELLED;
+		case -EPIPE:
+			return LIBUSB_TRANSFER_STALL;
+		case -ENODEV:
+		case -ESHUTDOWN:
+			return LIBUSB_TRANSFER_NO_DEVICE;
+		case -EOVERFLOW:
+			return LIBUSB_TRANSFER_OVERFLOW;
+		case -ETIMEDOUT:
+			return LIBUSB_TRANSFER_TIMED_OUT;
+		default:
+			return LIBUSB_TRANSFER_ERROR;
+	}
+}
+
+/**
+ * Move a probed device from its libusb handle over to usbfs. On failure
+ * the device stays on the libusb transport.
+ *
+ * @return 0 on success, a negative errno value otherwise
+ */
+int usb_usbfs_attach(struct usb_device *dev)
+{
+	char path[64];
+	unsigned int iface = dev->interface;
+	uint32_t caps = 0;
+	int fd, res;
+
+	snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d", dev->bus, dev->address);
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if(fd < 0) {
+		res = -errno;
+		usbmuxd_log(LL_WARNING, "Could not open %s, staying with libusb: %s", path, strerror(errno));
+		return res;
+	}
+
+	// without this the kernel splits our 48k TX packets and caps RX URBs
+	if(ioctl(fd, USBDEVFS_GET_CAPABILITIES, &caps) < 0 || !(caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM)) {
+		usbmuxd_log(LL_WARNING, "usbfs of device %d-%d has a bulk size limit, staying with libusb", dev->bus, dev->address);
+		close(fd);
+		return -ENOTSUP;
+	}
+
+	libusb_release_interface(dev->dev, dev->interface);
+	if(ioctl(fd, USBDEVFS_CLAIMINTERFACE, &iface) < 0) {
+		res = -errno;
+		usbmuxd_log(LL_WARNING, "Could not claim interface %d of device %d-%d through usbfs, staying with libusb: %s", dev->interface, dev->bus, dev->address, strerror(errno));
+		close(fd);
+		if(libusb_claim_interface(dev->dev, dev->interface) != 0) {
+			usbmuxd_log(LL_ERROR, "Could not claim interface %d of device %d-%d again", dev->interface, dev->bus, dev->address);
+			dev->alive = 0;
+		}
+		return res;
+	}
+
+	libusb_close(dev->dev);
+	dev->dev = NULL;
+	dev->usbfs_fd = fd;
+	dev->usbfs_caps = caps;
+	dev->transport = &usb_usbfs_transport;
+	usbmuxd_log(LL_INFO, "Device %d-%d now uses usbfs%s", dev->bus, dev->address, has_zero_packet(dev) ? "" : " (userspace ZLPs)");
+	return 0;
+}
+
+/**
+ * Submit count RX URBs.
+ *
+ * @return number of URBs submitted, or a negative errno value if none was
+ */
+int usb_usbfs_start_rx(struct usb_device *dev, int count)
+{
+	int submitted = 0;
+	int res = 0;
+	while(submitted < count) {
+		unsigned char *buf = malloc(USB_MRU);
+		struct usbfs_urb *u = buf ? urb_alloc(dev, 1, buf, USB_MRU) : NULL;
+		if(!u) {
+			free(buf);
+			res = -ENOMEM;
+			break;
+		}
+		if((res = urb_submit(u)) < 0) {
+			usbmuxd_log(LL_ERROR, "Failed to submit RX URB to device %d-%d: %s", dev->bus, dev->address, strerror(-res));
+			urb_free(u);
+			break;
+		}
+		submitted++;
+	}
+	return submitted ? submitted : res;
+}
+
+static int usbfs_send(struct usb_device *dev, unsigned char *buf, int length, int flags)
+{
+	struct usbfs_urb *u = urb_alloc(dev, 0, buf, length);
+	int res;
+	if(!u)
+		return -ENOMEM;
+	u->urb.flags = flags;
+	if((res = urb_submit(u)) < 0) {
+		u->urb.buffer = NULL; // owned by the caller on failure
+		urb_free(u);
+	}
+	return res;
+}
+
+static int usbfs_transport_send(struct usb_device *dev, unsigned char *buf, int length)
+{
+	int zlp = (length % dev->wMaxPacketSize == 0);
+	int res = usbfs_send(dev, buf, length, (zlp && has_zero_packet(dev)) ? USBDEVFS_URB_ZERO_PACKET : 0);
+	if(res < 0) {
+		usbmuxd_log(LL_ERROR, "Failed to submit TX URB %p len %d to device %d-%d: %s", buf, length, dev->bus, dev->address, strerror(-res));
+		return res;
+	}
+	if(zlp && !has_zero_packet(dev)) {
+		usbmuxd_log(LL_DEBUG, "Send ZLP");
+		void *buffer = malloc(1);
+		res = usbfs_send(dev, buffer, 0, 0);
+		if(res < 0) {
+			// the kernel holds buf in the data URB, which reaping frees;
+			// without its ZLP the packet is incomplete, give up on the device
+			free(buffer);
+			usbmuxd_log(LL_ERROR, "Failed to submit TX ZLP URB to device %d-%d: %s", dev->bus, dev->address, strerror(-res));
+			dev->alive = 0;
+		}
+	}
+	return 0;
+}
+
+static void usbfs_transport_disconnect(struct usb_device *dev)
+{
+	// discarded URBs still have to be reaped before they can be freed
+	FOREACH(struct usbfs_urb *u, &dev->rx_xfers) {
+		ioctl(dev->usbfs_fd, USBDEVFS_DISCARDURB, &u->urb);
+	} ENDFOREACH
+	FOREACH(struct usbfs_urb *u, &dev->tx_xfers) {
+		ioctl(dev->usbfs_fd, USBDEVFS_DISCARDURB, &u->urb);
+	} ENDFOREACH
+}
+
+static int usbfs_transport_disconnect_finished(struct usb_device *dev)
+{
+	unsigned int iface = dev->interface;
+	if(collection_count(&dev->rx_xfers) || collection_count(&dev->tx_xfers)) {
+		return 0;
+	}
+	if(dev->usbfs_fd >= 0) {
+		ioctl(dev->usbfs_fd, USBDEVFS_RELEASEINTERFACE, &iface);
+		close(dev->usbfs_fd);
+		dev->usbfs_fd = -1;
+	}
+	return 1;
+}
+
+const struct usb_transport usb_usbfs_transport = {
+	"usbfs",
+	usbfs_transport_send,
+	usbfs_transport_disconnect,
+	usbfs_transport_disconnect_finished,
+	1
+};
+
+void usb_usbfs_add_pollfd(struct fdlist *list, struct usb_device *dev)
+{
+	if(dev->usbfs_fd >= 0) {
+		// usbfs reports completed URBs as writable
+		fdlist_add_usb_fd(list, dev->usbfs_fd, POLLOUT);
+	}
+}
+
+static void urb_complete(struct usbfs_urb *u, struct collection *resubmit)
+{
+	struct usb_device *dev = u->dev;
+	int status = urb_status(u->urb.status);
+
+	if(u->rx) {
+		collection_remove(&dev->rx_xfers, u);
+		usb_xfer_stats_completed(&dev->rx_stats, status, u->urb.actual_length, u->submit_time);
+		usbmuxd_log(LL_SPEW, "RX URB dev %d-%d len %d status %d", dev->bus, dev->address, u->urb.actual_length, u->urb.status);
+		if(dev->state == USBDEV_DISCONNECTING) {
+			urb_free(u);
+		} else if(status == LIBUSB_TRANSFER_COMPLETED) {
+			device_data_input(dev, u->urb.buffer, u->urb.actual_length);
+			if(usb_rx_resubmit_allowed(dev, collection_count(&dev->rx_xfers) + collection_count(resubmit)))
+				collection_add(resubmit, u);
+			else
+				urb_free(u);
+		} else {
+			usbmuxd_log(LL_INFO, "Device %d-%d RX URB failed: %s", dev->bus, dev->address, strerror(-u->urb.status));
+			urb_free(u);
+			dev->alive = 0;
+		}
+	} else {
+		collection_remove(&dev->tx_xfers, u);
+		usb_xfer_stats_completed(&dev->tx_stats, status, u->urb.actual_length, u->submit_time);
+		usbmuxd_log(LL_SPEW, "TX URB dev %d-%d len %d -> %d status %d", dev->bus, dev->address, u->urb.buffer_length, u->urb.actual_length, u->urb.status);
+		if(status != LIBUSB_TRANSFER_COMPLETED && status != LIBUSB_TRANSFER_CANCELLED) {
+			usbmuxd_log(LL_INFO, "Device %d-%d TX URB failed: %s", dev->bus, dev->address, strerror(-u->urb.status));
+			dev->alive = 0;
+		}
+		int length = u->urb.buffer_length;
+		urb_free(u);
+		usb_device_tx_done(dev, length);
+	}
+}
+
+/**
+ * Reap every completed URB of this device, then resubmit the RX URBs
+ * among them in one go.
+ */
+void usb_usbfs_process(struct usb_device *dev)
+{
+	struct collection resubmit;
+	struct usbdevfs_urb *urb;
+	int reaped = 0;
+
+	if(dev->usbfs_fd < 0)
+		return;
+
+	collection_init(&resubmit);
+	while(1) {
+		if(ioctl(dev->usbfs_fd, USBDEVFS_REAPURBNDELAY, &urb) < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN) {
+				// gone: the kernel has handed back everything it still had
+				usbmuxd_log(LL_INFO, "Device %d-%d usbfs reap failed: %s", dev->bus, dev->address, strerror(errno));
+				// dead first, so that usb_device_tx_done() submits nothing
+				dev->alive = 0;
+				FOREACH(struct usbfs_urb *u, &dev->rx_xfers) {
+					collection_remove(&dev->rx_xfers, u);
+					urb_free(u);
+				} ENDFOREACH
+				FOREACH(struct usbfs_urb *u, &dev->tx_xfers) {
+					int length = u->urb.buffer_length;
+					collection_remove(&dev->tx_xfers, u);
+					urb_free(u);
+					usb_device_tx_done(dev, length);
+				} ENDFOREACH
+			}
+			break;
+		}
+		urb_complete((struct usbfs_urb *)urb, &resubmit);
+		reaped++;
+	}
+	if(reaped)
+		usbmuxd_log(LL_SPEW, "Reaped %d URBs from device %d-%d", reaped, dev->bus, dev->address);
+
+	FOREACH(struct usbfs_urb *u, &resubmit) {
+		int res;
+		if(dev->state == USBDEV_DISCONNECTING || !dev->alive) {
+			urb_free(u);
+		} else if((res = urb_submit(u)) < 0) {
+			usbmuxd_log(LL_ERROR, "Failed to resubmit RX URB to device %d-%d: %s", dev->bus, dev->address, strerror(-res));
+			urb_free(u);
+			dev->alive = 0;
+		}
+	} ENDFOREACH
+	collection_free(&resubmit);
+}
+
+#endif
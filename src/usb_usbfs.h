@@ -0,0 +1,31 @@
+/*
+ * usb_usbfs.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef USB_USBFS_H
+#define USB_USBFS_H
+
+#include "fdlist.h"
+#include "usb_device.h"
+
+extern const struct usb_transport usb_usbfs_transport;
+
+int usb_usbfs_attach(struct usb_device *dev);
+int usb_usbfs_start_rx(struct usb_device *dev, int count);
+void usb_usbfs_add_pollfd(struct fdlist *list, struct usb_device *dev);
+void usb_usbfs_process(struct usb_device *dev);
+
+#endif
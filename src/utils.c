@@ -274,3 +274,14 @@ uint64_t mstime64(void)
 	// time_t could be 4 bytes
 	return ((long long)tv.tv_sec) * 1000LL + ((long long)tv.tv_usec) / 1000LL;
 }
+
+/**
+ * Get a monotonic timestamp in microseconds.
+ */
+uint64_t ustime64(void)
+{
+	struct timeval tv;
+	get_tick_count(&tv);
+
+	return ((uint64_t)tv.tv_sec) * 1000000ULL + (uint64_t)tv.tv_usec;
+}
@@ -51,6 +51,7 @@ int plist_read_from_filename(plist_t *plist, const char *filename);
 int plist_write_to_filename(plist_t plist, const char *filename);
 
 uint64_t mstime64(void);
+uint64_t ustime64(void);
 void get_tick_count(struct timeval * tv);
 
 #endif
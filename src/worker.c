@@ -0,0 +1,236 @@
+/*
+ * worker.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "worker.h"
+#include "log.h"
+
+/*
+ * A small pool of threads for operations that may block, like
+ * configuring a freshly attached USB device. Jobs run on a worker
+ * thread; their completion callback is run on the main thread from
+ * worker_process(), which the main loop calls whenever the fd
+ * returned by worker_get_fd() becomes readable.
+ */
+
+struct worker_job {
+	worker_job_cb job;
+	worker_done_cb done;
+	void *data;
+	struct worker_job *next;
+};
+
+struct worker_queue {
+	struct worker_job *head;
+	struct worker_job *tail;
+};
+
+static pthread_t *threads;
+static int num_threads;
+static int should_stop;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct worker_queue pending;
+static struct worker_queue finished;
+static int notify_pipe[2] = { -1, -1 };
+
+static void queue_push(struct worker_queue *queue, struct worker_job *job)
+{
+	job->next = NULL;
+	if (queue->tail)
+		queue->tail->next = job;
+	else
+		queue->head = job;
+	queue->tail = job;
+}
+
+static struct worker_job *queue_pop(struct worker_queue *queue)
+{
+	struct worker_job *job = queue->head;
+	if (job) {
+		queue->head = job->next;
+		if (!queue->head)
+			queue->tail = NULL;
+	}
+	return job;
+}
+
+static void queue_discard(struct worker_queue *queue)
+{
+	struct worker_job *job;
+	while ((job = queue_pop(queue)))
+		free(job);
+}
+
+static void *worker_thread(void *arg)
+{
+	pthread_mutex_lock(&queue_mutex);
+	while (1) {
+		struct worker_job *job;
+		while (!should_stop && !pending.head)
+			pthread_cond_wait(&queue_cond, &queue_mutex);
+		if (should_stop)
+			break;
+		job = queue_pop(&pending);
+		pthread_mutex_unlock(&queue_mutex);
+
+		job->job(job->data);
+
+		pthread_mutex_lock(&queue_mutex);
+		queue_push(&finished, job);
+		if (write(notify_pipe[1], "", 1) < 0 && errno != EAGAIN) {
+			usbmuxd_log(LL_ERROR, "%s: Could not notify main thread: %s", __func__, strerror(errno));
+		}
+	}
+	pthread_mutex_unlock(&queue_mutex);
+	return NULL;
+}
+
+static int set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0)
+		return -1;
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -1;
+	return fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+int worker_init(int count)
+{
+	if (pipe(notify_pipe) < 0) {
+		usbmuxd_log(LL_FATAL, "%s: pipe() failed: %s", __func__, strerror(errno));
+		return -1;
+	}
+	if (set_nonblocking(notify_pipe[0]) < 0 || set_nonblocking(notify_pipe[1]) < 0) {
+		usbmuxd_log(LL_FATAL, "%s: Could not set up notification pipe: %s", __func__, strerror(errno));
+		return -1;
+	}
+
+	should_stop = 0;
+	threads = malloc(sizeof(pthread_t) * count);
+	for (num_threads = 0; num_threads < count; num_threads++) {
+		int perr = pthread_create(&threads[num_threads], NULL, worker_thread, NULL);
+		if (perr != 0) {
+			usbmuxd_log(LL_ERROR, "%s: Failed to start worker thread: %s (%d)", __func__, strerror(perr), perr);
+			break;
+		}
+	}
+	if (num_threads == 0) {
+		usbmuxd_log(LL_FATAL, "%s: Could not start any worker thread", __func__);
+		return -1;
+	}
+	usbmuxd_log(LL_DEBUG, "Started %d worker threads", num_threads);
+	return num_threads;
+}
+
+/**
+ * Stop all worker threads. Jobs that are currently running are waited
+ * for; jobs that did not start yet and completion callbacks that were
+ * not run yet are discarded, the caller owns the job data.
+ */
+void worker_shutdown(void)
+{
+	int i;
+
+	pthread_mutex_lock(&queue_mutex);
+	should_stop = 1;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_mutex);
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	threads = NULL;
+	num_threads = 0;
+
+	queue_discard(&pending);
+	queue_discard(&finished);
+
+	close(notify_pipe[0]);
+	close(notify_pipe[1]);
+	notify_pipe[0] = notify_pipe[1] = -1;
+}
+
+/**
+ * Queue a job for the worker pool.
+ *
+ * @param job Function that is called on a worker thread.
+ * @param done Function that is called on the main thread after job
+ *   has returned. May be NULL.
+ * @param data Passed to both functions.
+ * @return 0 on success, -1 on error.
+ */
+int worker_queue(worker_job_cb job, worker_done_cb done, void *data)
+{
+	struct worker_job *wjob;
+
+	if (!num_threads)
+		return -1;
+
+	wjob = malloc(sizeof(struct worker_job));
+	if (!wjob)
+		return -1;
+	wjob->job = job;
+	wjob->done = done;
+	wjob->data = data;
+
+	pthread_mutex_lock(&queue_mutex);
+	queue_push(&pending, wjob);
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_mutex);
+	return 0;
+}
+
+int worker_get_fd(void)
+{
+	return notify_pipe[0];
+}
+
+/**
+ * Run the completion callbacks of all finished jobs. Must be called on
+ * the main thread.
+ */
+void worker_process(void)
+{
+	char buf[64];
+	struct worker_job *job;
+
+	while (read(notify_pipe[0], buf, sizeof(buf)) > 0);
+
+	while (1) {
+		pthread_mutex_lock(&queue_mutex);
+		job = queue_pop(&finished);
+		pthread_mutex_unlock(&queue_mutex);
+		if (!job)
+			break;
+		if (job->done)
+			job->done(job->data);
+		free(job);
+	}
+}
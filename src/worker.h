@@ -0,0 +1,32 @@
+/*
+ * worker.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+// runs on one of the worker threads and may block
+typedef void (*worker_job_cb)(void *data);
+// runs on the main thread once the job has finished
+typedef void (*worker_done_cb)(void *data);
+
+int worker_init(int num_threads);
+void worker_shutdown(void);
+int worker_queue(worker_job_cb job, worker_done_cb done, void *data);
+int worker_get_fd(void);
+void worker_process(void);
+
+#endif